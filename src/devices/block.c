@@ -3,7 +3,64 @@
 #include <string.h>
 #include <stdio.h>
 #include "devices/ide.h"
+#include "devices/timer.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+
+/* Maximum number of sectors the dispatcher merges into one
+   transfer. */
+#define BLOCK_MERGE_SECTORS 128
+
+/* Number of timer ticks a request may wait in its I/O class
+   before it is promoted to the next more urgent class. */
+#define BLOCK_IO_AGING_TICKS (TIMER_FREQ / 10)
+
+/* A request waiting in a block device's queue. */
+struct block_request
+  {
+    struct list_elem elem;              /* Element in the queue. */
+    block_sector_t sector;              /* First sector. */
+    size_t cnt;                         /* Number of sectors. */
+    void *const *buffers;               /* One buffer per sector. */
+    bool write;                         /* Write rather than read? */
+    enum block_io_class io_class;       /* Class it was submitted in. */
+    enum block_io_class queued_class;   /* Class it is queued in. */
+    int64_t submit_time;                /* Timer tick of submission. */
+    int64_t class_time;                 /* Tick it entered its class. */
+    struct semaphore done;              /* Up'd when transferred. */
+  };
+
+/* Requests to a block device waiting for its dispatcher.  The
+   dispatcher serves the most urgent I/O class with requests
+   first, and within a class serves requests in C-LOOK order: in
+   ascending sector order from the sector after the last
+   transfer, then back to the lowest pending sector.  Requests
+   waiting BLOCK_IO_AGING_TICKS in a class move up a class, so
+   that no class starves. */
+struct block_queue
+  {
+    struct lock lock;                   /* Protects the members below. */
+    struct condition not_empty;         /* Signalled on submission. */
+    bool running;                       /* Dispatcher started? */
+    struct list requests[BLOCK_IO_CLASS_CNT]; /* By ascending sector. */
+    size_t depth;                       /* Number of pending requests. */
+    block_sector_t head;                /* Sector after last transfer. */
+
+    unsigned long long request_cnt;     /* Number of requests queued. */
+    unsigned long long transfer_cnt;    /* Number of driver transfers. */
+    unsigned long long depth_sum;       /* Sum of depths on submission. */
+    size_t max_depth;                   /* Greatest depth seen. */
+    unsigned long long aged_cnt;        /* Number of promotions. */
+    struct block_class_stats
+      {
+        unsigned long long request_cnt; /* Number of requests. */
+        int64_t latency_sum;            /* Sum of latencies in ticks. */
+        int64_t max_latency;            /* Greatest latency in ticks. */
+      }
+    classes[BLOCK_IO_CLASS_CNT];
+  };
 
 /* A block device. */
 struct block
@@ -19,6 +76,11 @@ struct block
 
     unsigned long long read_cnt;        /* Number of sectors read. */
     unsigned long long write_cnt;       /* Number of sectors written. */
+    unsigned long long read_req_cnt;    /* Number of read requests. */
+    unsigned long long write_req_cnt;   /* Number of write requests. */
+
+    bool pass_through;                  /* Bypass the queue? */
+    struct block_queue queue;           /* Requests for the driver. */
   };
 
 /* List of all block devices. */
@@ -28,6 +90,11 @@ static struct list all_blocks = LIST_INITIALIZER (all_blocks);
 static struct block *block_by_role[BLOCK_ROLE_CNT];
 
 static struct block *list_elem_to_block (struct list_elem *);
+static void transfer (struct block *, block_sector_t, size_t cnt,
+                      void *const buffers[], bool write);
+static void submit (struct block *, block_sector_t, size_t cnt,
+                    void *const buffers[], bool write);
+static void dispatcher (void *block_);
 
 /* Returns a human-readable name for the given block device
    TYPE. */
@@ -121,8 +188,9 @@ void
 block_read (struct block *block, block_sector_t sector, void *buffer)
 {
   check_sector (block, sector);
-  block->ops->read (block->aux, sector, buffer);
+  submit (block, sector, 1, &buffer, false);
   block->read_cnt++;
+  block->read_req_cnt++;
 }
 
 /* Write sector SECTOR to BLOCK from BUFFER, which must contain
@@ -135,8 +203,46 @@ block_write (struct block *block, block_sector_t sector, const void *buffer)
 {
   check_sector (block, sector);
   ASSERT (block->type != BLOCK_FOREIGN);
-  block->ops->write (block->aux, sector, buffer);
+  submit (block, sector, 1, (void *const *) &buffer, true);
   block->write_cnt++;
+  block->write_req_cnt++;
+}
+
+/* Reads the CNT sectors starting at SECTOR from BLOCK, as a
+   single request if the driver supports it.  BUFFERS holds a
+   buffer with room for BLOCK_SECTOR_SIZE bytes for each sector.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_read_multiple (struct block *block, block_sector_t sector, size_t cnt,
+                     void *const buffers[])
+{
+  ASSERT (cnt > 0);
+  check_sector (block, sector);
+  check_sector (block, sector + cnt - 1);
+  submit (block, sector, cnt, buffers, false);
+  block->read_cnt += cnt;
+  block->read_req_cnt++;
+}
+
+/* Writes the CNT sectors starting at SECTOR to BLOCK, as a
+   single request if the driver supports it.  BUFFERS holds a
+   buffer containing BLOCK_SECTOR_SIZE bytes for each sector.
+   Returns after the block device has acknowledged receiving the
+   data.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_write_multiple (struct block *block, block_sector_t sector, size_t cnt,
+                      const void *const buffers[])
+{
+  ASSERT (cnt > 0);
+  check_sector (block, sector);
+  check_sector (block, sector + cnt - 1);
+  ASSERT (block->type != BLOCK_FOREIGN);
+  submit (block, sector, cnt, (void *const *) buffers, true);
+  block->write_cnt += cnt;
+  block->write_req_cnt++;
 }
 
 /* Returns the number of sectors in BLOCK. */
@@ -160,10 +266,42 @@ block_type (struct block *block)
   return block->type;
 }
 
-/* Prints statistics for each block device used for a Pintos role. */
+/* Sets the I/O class of the block requests the current thread
+   submits to CLASS, returning its previous class so that the
+   caller can restore it. */
+enum block_io_class
+block_set_io_class (enum block_io_class class)
+{
+  struct thread *t = thread_current ();
+  enum block_io_class old_class = t->io_class;
+
+  ASSERT (class < BLOCK_IO_CLASS_CNT);
+  t->io_class = class;
+  return old_class;
+}
+
+/* Marks BLOCK as passing its requests through to another block
+   device, such as a partition does to its disk.  Requests to
+   BLOCK then go straight to its driver, to be queued and ordered
+   by the device underneath. */
+void
+block_set_pass_through (struct block *block)
+{
+  block->pass_through = true;
+}
+
+/* Prints statistics for each block device used for a Pintos role,
+   then queueing statistics for each device that queues requests. */
 void
 block_print_stats (void)
 {
+  static const char *class_names[BLOCK_IO_CLASS_CNT] =
+    {
+      "fault-in",
+      "foreground",
+      "background",
+    };
+  struct list_elem *e;
   int i;
 
   for (i = 0; i < BLOCK_ROLE_CNT; i++)
@@ -171,9 +309,37 @@ block_print_stats (void)
       struct block *block = block_by_role[i];
       if (block != NULL)
         {
-          printf ("%s (%s): %llu reads, %llu writes\n",
+          printf ("%s (%s): %llu reads, %llu writes "
+                  "(%llu read requests, %llu write requests)\n",
                   block->name, block_type_name (block->type),
-                  block->read_cnt, block->write_cnt);
+                  block->read_cnt, block->write_cnt,
+                  block->read_req_cnt, block->write_req_cnt);
+        }
+    }
+
+  for (e = list_begin (&all_blocks); e != list_end (&all_blocks);
+       e = list_next (e))
+    {
+      struct block *block = list_entry (e, struct block, list_elem);
+      struct block_queue *q = &block->queue;
+      if (block->pass_through || q->request_cnt == 0)
+        continue;
+
+      printf ("%s queue: %llu requests in %llu transfers, "
+              "depth %llu.%02llu avg, %zu max, %llu aged\n",
+              block->name, q->request_cnt, q->transfer_cnt,
+              q->depth_sum / q->request_cnt,
+              q->depth_sum * 100 / q->request_cnt % 100, q->max_depth,
+              q->aged_cnt);
+      for (i = 0; i < BLOCK_IO_CLASS_CNT; i++)
+        {
+          struct block_class_stats *c = &q->classes[i];
+          if (c->request_cnt > 0)
+            printf ("  %s: %llu requests, "
+                    "latency %lld avg, %lld max ticks\n",
+                    class_names[i], c->request_cnt,
+                    c->latency_sum / (int64_t) c->request_cnt,
+                    c->max_latency);
         }
     }
 }
@@ -189,6 +355,8 @@ block_register (const char *name, enum block_type type,
                 const struct block_operations *ops, void *aux)
 {
   struct block *block = malloc (sizeof *block);
+  int i;
+
   if (block == NULL)
     PANIC ("Failed to allocate memory for block device descriptor");
 
@@ -200,6 +368,27 @@ block_register (const char *name, enum block_type type,
   block->aux = aux;
   block->read_cnt = 0;
   block->write_cnt = 0;
+  block->read_req_cnt = 0;
+  block->write_req_cnt = 0;
+  block->pass_through = false;
+
+  lock_init (&block->queue.lock);
+  cond_init (&block->queue.not_empty);
+  block->queue.running = false;
+  for (i = 0; i < BLOCK_IO_CLASS_CNT; i++)
+    {
+      list_init (&block->queue.requests[i]);
+      block->queue.classes[i].request_cnt = 0;
+      block->queue.classes[i].latency_sum = 0;
+      block->queue.classes[i].max_latency = 0;
+    }
+  block->queue.depth = 0;
+  block->queue.head = 0;
+  block->queue.request_cnt = 0;
+  block->queue.transfer_cnt = 0;
+  block->queue.depth_sum = 0;
+  block->queue.max_depth = 0;
+  block->queue.aged_cnt = 0;
 
   printf ("%s: %'"PRDSNu" sectors (", block->name, block->size);
   print_human_readable_size ((uint64_t) block->size * BLOCK_SECTOR_SIZE);
@@ -221,3 +410,252 @@ list_elem_to_block (struct list_elem *list_elem)
           : NULL);
 }
 
+
+/* Has BLOCK's driver transfer the CNT sectors starting at SECTOR
+   between the device and BUFFERS, one buffer per sector, writing
+   to the device if WRITE is true. */
+static void
+transfer (struct block *block, block_sector_t sector, size_t cnt,
+          void *const buffers[], bool write)
+{
+  size_t i;
+
+  if (write && block->ops->write_multiple != NULL)
+    block->ops->write_multiple (block->aux, sector, cnt,
+                                (const void *const *) buffers);
+  else if (!write && block->ops->read_multiple != NULL)
+    block->ops->read_multiple (block->aux, sector, cnt, buffers);
+  else if (write)
+    for (i = 0; i < cnt; i++)
+      block->ops->write (block->aux, sector + i, buffers[i]);
+  else
+    for (i = 0; i < cnt; i++)
+      block->ops->read (block->aux, sector + i, buffers[i]);
+}
+
+/* Returns true if all of the CNT BUFFERS are kernel addresses,
+   which are mapped in every thread, including the dispatcher. */
+static bool
+kernel_buffers (void *const buffers[], size_t cnt)
+{
+  size_t i;
+
+  for (i = 0; i < cnt; i++)
+    if (!is_kernel_vaddr (buffers[i]))
+      return false;
+  return true;
+}
+
+/* Returns true if request A starts before request B. */
+static bool
+request_less (const struct list_elem *a_, const struct list_elem *b_,
+              void *aux UNUSED)
+{
+  const struct block_request *a = list_entry (a_, struct block_request, elem);
+  const struct block_request *b = list_entry (b_, struct block_request, elem);
+
+  return a->sector < b->sector;
+}
+
+/* Queues a request to transfer the CNT sectors starting at
+   SECTOR between BLOCK and BUFFERS, one buffer per sector,
+   writing to BLOCK if WRITE is true, and waits for BLOCK's
+   dispatcher to complete it.  A request with buffers in user
+   memory is transferred by the calling thread instead, as only
+   its page directory maps them. */
+static void
+submit (struct block *block, block_sector_t sector, size_t cnt,
+        void *const buffers[], bool write)
+{
+  struct block_queue *q = &block->queue;
+  struct block_request r;
+
+  if (block->pass_through || !kernel_buffers (buffers, cnt))
+    {
+      transfer (block, sector, cnt, buffers, write);
+      return;
+    }
+
+  r.sector = sector;
+  r.cnt = cnt;
+  r.buffers = buffers;
+  r.write = write;
+  r.io_class = r.queued_class = thread_current ()->io_class;
+  r.submit_time = r.class_time = timer_ticks ();
+  sema_init (&r.done, 0);
+
+  lock_acquire (&q->lock);
+  if (!q->running)
+    {
+      /* Start the dispatcher on first use, so that devices which
+         pass their requests through never get one. */
+      char name[16];
+      snprintf (name, sizeof name, "%s-io", block->name);
+      thread_create (name, PRI_DEFAULT, dispatcher, block);
+      q->running = true;
+    }
+  list_insert_ordered (&q->requests[r.queued_class], &r.elem,
+                       request_less, NULL);
+  q->depth++;
+  q->request_cnt++;
+  q->depth_sum += q->depth;
+  if (q->depth > q->max_depth)
+    q->max_depth = q->depth;
+  cond_signal (&q->not_empty, &q->lock);
+  lock_release (&q->lock);
+
+  sema_down (&r.done);
+}
+
+/* Moves the requests of queue Q which have waited
+   BLOCK_IO_AGING_TICKS in their I/O class up to the next more
+   urgent class.  Q must be locked. */
+static void
+age_requests (struct block_queue *q)
+{
+  int64_t now = timer_ticks ();
+  int class;
+
+  for (class = 1; class < BLOCK_IO_CLASS_CNT; class++)
+    {
+      struct list *requests = &q->requests[class];
+      struct list_elem *e = list_begin (requests);
+
+      while (e != list_end (requests))
+        {
+          struct block_request *r = list_entry (e, struct block_request,
+                                                elem);
+          e = list_next (e);
+          if (now - r->class_time < BLOCK_IO_AGING_TICKS)
+            continue;
+
+          list_remove (&r->elem);
+          r->queued_class = class - 1;
+          r->class_time = now;
+          list_insert_ordered (&q->requests[class - 1], &r->elem,
+                               request_less, NULL);
+          q->aged_cnt++;
+        }
+    }
+}
+
+/* Returns the requests of queue Q in the most urgent I/O class
+   that has any, after aging Q's requests.  Q must be locked and
+   not empty. */
+static struct list *
+next_class (struct block_queue *q)
+{
+  int class;
+
+  age_requests (q);
+  for (class = 0; class < BLOCK_IO_CLASS_CNT; class++)
+    if (!list_empty (&q->requests[class]))
+      return &q->requests[class];
+  NOT_REACHED ();
+}
+
+/* Removes the next request to serve from REQUESTS, the requests
+   of one I/O class in queue Q, in C-LOOK order, together with
+   the requests following it that continue it in the same
+   direction, up to BLOCK_MERGE_SECTORS sectors in all, and moves
+   them in order to BATCH.  Returns the number of sectors moved.
+   Q must be locked and REQUESTS not empty. */
+static size_t
+take_batch (struct block_queue *q, struct list *requests, struct list *batch)
+{
+  struct list_elem *e;
+  struct block_request *first;
+  size_t sector_cnt;
+
+  for (e = list_begin (requests); e != list_end (requests);
+       e = list_next (e))
+    if (list_entry (e, struct block_request, elem)->sector >= q->head)
+      break;
+  if (e == list_end (requests))
+    e = list_begin (requests);
+
+  first = list_entry (e, struct block_request, elem);
+  sector_cnt = 0;
+  for (;;)
+    {
+      struct block_request *r = list_entry (e, struct block_request, elem);
+
+      e = list_remove (e);
+      list_push_back (batch, &r->elem);
+      q->depth--;
+      sector_cnt += r->cnt;
+
+      if (e == list_end (requests))
+        break;
+      r = list_entry (e, struct block_request, elem);
+      if (r->write != first->write
+          || r->sector != first->sector + sector_cnt
+          || sector_cnt + r->cnt > BLOCK_MERGE_SECTORS)
+        break;
+    }
+  q->head = first->sector + sector_cnt;
+  return sector_cnt;
+}
+
+/* Serves the requests queued for BLOCK, merging adjacent
+   requests of the same I/O class into single transfers. */
+static void
+dispatcher (void *block_)
+{
+  struct block *block = block_;
+  struct block_queue *q = &block->queue;
+
+  lock_acquire (&q->lock);
+  for (;;)
+    {
+      struct list batch;
+      struct block_request *first;
+      size_t sector_cnt;
+
+      while (q->depth == 0)
+        cond_wait (&q->not_empty, &q->lock);
+
+      list_init (&batch);
+      sector_cnt = take_batch (q, next_class (q), &batch);
+      q->transfer_cnt++;
+      lock_release (&q->lock);
+
+      first = list_entry (list_front (&batch), struct block_request, elem);
+      if (list_size (&batch) == 1)
+        transfer (block, first->sector, first->cnt, first->buffers,
+                  first->write);
+      else
+        {
+          void *buffers[BLOCK_MERGE_SECTORS];
+          struct list_elem *e;
+          size_t i = 0;
+
+          for (e = list_begin (&batch); e != list_end (&batch);
+               e = list_next (e))
+            {
+              struct block_request *r;
+              size_t j;
+
+              r = list_entry (e, struct block_request, elem);
+              for (j = 0; j < r->cnt; j++)
+                buffers[i++] = r->buffers[j];
+            }
+          transfer (block, first->sector, sector_cnt, buffers, first->write);
+        }
+
+      lock_acquire (&q->lock);
+      while (!list_empty (&batch))
+        {
+          struct block_request *r = list_entry (list_pop_front (&batch),
+                                                struct block_request, elem);
+          struct block_class_stats *c = &q->classes[r->io_class];
+          int64_t latency = timer_elapsed (r->submit_time);
+
+          c->request_cnt++;
+          c->latency_sum += latency;
+          if (latency > c->max_latency)
+            c->max_latency = latency;
+          sema_up (&r->done);
+        }
+    }
+}
@@ -22,6 +22,17 @@ typedef uint32_t block_sector_t;
 
 struct block;
 
+/* I/O priority class of a block request, from the most urgent
+   to the least.  A request takes the class of the thread that
+   submits it. */
+enum block_io_class
+  {
+    BLOCK_IO_FAULT,              /* Read to resolve a page fault. */
+    BLOCK_IO_FOREGROUND,         /* File I/O a process waits for. */
+    BLOCK_IO_BACKGROUND,         /* Write-back of evicted pages. */
+    BLOCK_IO_CLASS_CNT
+  };
+
 /* Type of a block device. */
 enum block_type
   {
@@ -53,22 +64,46 @@ struct block *block_next (struct block *);
 block_sector_t block_size (struct block *);
 void block_read (struct block *, block_sector_t, void *);
 void block_write (struct block *, block_sector_t, const void *);
+void block_read_multiple (struct block *, block_sector_t, size_t cnt,
+                          void *const buffers[]);
+void block_write_multiple (struct block *, block_sector_t, size_t cnt,
+                           const void *const buffers[]);
 const char *block_name (struct block *);
 enum block_type block_type (struct block *);
+enum block_io_class block_set_io_class (enum block_io_class);
 
 /* Statistics. */
 void block_print_stats (void);
 
 /* Lower-level interface to block device drivers. */
 
+/* READ_MULTIPLE and WRITE_MULTIPLE transfer CNT consecutive
+   sectors, starting at the given one, to or from BUFFERS, which
+   holds one BLOCK_SECTOR_SIZE buffer per sector.  They may be
+   null, in which case the block layer transfers one sector at a
+   time.  Buffers may be in user memory, so drivers that need
+   physical addresses, such as for DMA, must fall back to another
+   method for buffers that are not kernel addresses. */
 struct block_operations
   {
     void (*read) (void *aux, block_sector_t, void *buffer);
     void (*write) (void *aux, block_sector_t, const void *buffer);
+    void (*read_multiple) (void *aux, block_sector_t, size_t cnt,
+                           void *const buffers[]);
+    void (*write_multiple) (void *aux, block_sector_t, size_t cnt,
+                            const void *const buffers[]);
   };
 
 struct block *block_register (const char *name, enum block_type,
                               const char *extra_info, block_sector_t size,
                               const struct block_operations *, void *aux);
 
+/* Requests to a block device are queued and served by a
+   dispatcher thread, which orders them by sector and merges
+   adjacent ones, unless the device passes them through to
+   another block device.  The dispatcher only sees kernel
+   memory, so requests with user buffers bypass the queue and
+   are served by the thread that makes them. */
+void block_set_pass_through (struct block *);
+
 #endif /* devices/block.h */
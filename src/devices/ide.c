@@ -8,7 +8,9 @@
 #include "devices/timer.h"
 #include "threads/io.h"
 #include "threads/interrupt.h"
+#include "threads/palloc.h"
 #include "threads/synch.h"
+#include "threads/vaddr.h"
 
 /* The code in this file is an interface to an ATA (IDE)
    controller.  It attempts to comply to [ATA-3]. */
@@ -33,7 +35,9 @@
 /* Alternate Status Register bits. */
 #define STA_BSY 0x80            /* Busy. */
 #define STA_DRDY 0x40           /* Device Ready. */
+#define STA_DF 0x20             /* Device Fault. */
 #define STA_DRQ 0x08            /* Data Request. */
+#define STA_ERR 0x01            /* Error. */
 
 /* Control Register bits. */
 #define CTL_SRST 0x04           /* Software Reset. */
@@ -49,6 +53,39 @@
 #define CMD_IDENTIFY_DEVICE 0xec        /* IDENTIFY DEVICE. */
 #define CMD_READ_SECTOR_RETRY 0x20      /* READ SECTOR with retries. */
 #define CMD_WRITE_SECTOR_RETRY 0x30     /* WRITE SECTOR with retries. */
+#define CMD_READ_DMA 0xc8               /* READ DMA. */
+#define CMD_WRITE_DMA 0xca              /* WRITE DMA. */
+
+/* Bus master IDE port addresses, relative to the channel's
+   bus master base.  See the Intel PIIX datasheet and [SFF-8038i]. */
+#define reg_bm_command(CHANNEL) ((CHANNEL)->bm_base + 0)  /* Command. */
+#define reg_bm_status(CHANNEL) ((CHANNEL)->bm_base + 2)   /* Status. */
+#define reg_bm_prdt(CHANNEL) ((CHANNEL)->bm_base + 4)     /* PRDT address. */
+
+/* Bus master Command Register bits. */
+#define BM_CMD_START 0x01       /* Start the transfer. */
+#define BM_CMD_READ 0x08        /* Transfer from the disk to memory. */
+
+/* Bus master Status Register bits. */
+#define BM_STA_ERROR 0x02       /* Transfer failed (write 1 to clear). */
+#define BM_STA_INTR 0x04        /* Disk interrupted (write 1 to clear). */
+
+/* IDENTIFY DEVICE word 49 bit indicating DMA support. */
+#define ID_CAP_DMA 0x0100
+
+/* PCI configuration space access. */
+#define PCI_CONFIG_ADDRESS 0xcf8
+#define PCI_CONFIG_DATA 0xcfc
+#define PCI_REG_COMMAND 0x04    /* Command register. */
+#define PCI_REG_CLASS 0x08      /* Class code and revision. */
+#define PCI_REG_BAR4 0x20       /* Bus master base for IDE. */
+#define PCI_CMD_IO 0x0001       /* Enable I/O space. */
+#define PCI_CMD_BUS_MASTER 0x0004       /* Enable bus mastering. */
+#define PCI_CLASS_IDE 0x0101    /* Mass storage, IDE. */
+
+/* Most sectors a single READ SECTOR or WRITE SECTOR command can
+   transfer.  A sector count of 0 in the command means 256. */
+#define MAX_SECTORS_PER_COMMAND 256
 
 /* An ATA device. */
 struct ata_disk
@@ -57,8 +94,21 @@ struct ata_disk
     struct channel *channel;    /* Channel that disk is attached to. */
     int dev_no;                 /* Device 0 or 1 for master or slave. */
     bool is_ata;                /* Is device an ATA disk? */
+    bool use_dma;               /* Transfer with bus master DMA? */
   };
 
+/* A physical region descriptor, telling the bus master where in
+   physical memory to transfer part of the data to or from.  A
+   region must not cross a 64 kB boundary. */
+struct prd
+  {
+    uint32_t phys_addr;         /* Physical address of the region. */
+    uint16_t byte_cnt;          /* Size of the region, 0 for 64 kB. */
+    uint16_t flags;             /* PRD_EOT in the last descriptor. */
+  };
+#define PRD_EOT 0x8000          /* End of table. */
+#define PRD_MAX (PGSIZE / sizeof (struct prd))
+
 /* An ATA channel (aka controller).
    Each channel can control up to two disks. */
 struct channel
@@ -72,6 +122,9 @@ struct channel
                                    any interrupt would be spurious. */
     struct semaphore completion_wait;   /* Up'd by interrupt handler. */
 
+    uint16_t bm_base;           /* Bus master base port, 0 if none. */
+    struct prd *prdt;           /* Physical region descriptor table. */
+
     struct ata_disk devices[2];     /* The devices on this channel. */
   };
 
@@ -85,8 +138,12 @@ static void reset_channel (struct channel *);
 static bool check_device_type (struct ata_disk *);
 static void identify_ata_device (struct ata_disk *);
 
-static void select_sector (struct ata_disk *, block_sector_t);
+static void select_sector (struct ata_disk *, block_sector_t, size_t cnt);
 static void issue_pio_command (struct channel *, uint8_t command);
+static void ide_read_multiple (void *d_, block_sector_t, size_t cnt,
+                               void *const buffers[]);
+static void ide_write_multiple (void *d_, block_sector_t, size_t cnt,
+                                const void *const buffers[]);
 static void input_sector (struct channel *, void *);
 static void output_sector (struct channel *, const void *);
 
@@ -97,11 +154,26 @@ static void select_device_wait (const struct ata_disk *);
 
 static void interrupt_handler (struct intr_frame *);
 
+static uint16_t find_bus_master (void);
+static uint32_t pci_read_config (int bus, int dev, int func, int reg);
+static void pci_write_config (int bus, int dev, int func, int reg,
+                              uint32_t value);
+static void dma_transfer (struct ata_disk *, block_sector_t, size_t cnt,
+                          const void *const buffers[], bool write);
+static size_t build_prdt (struct channel *, size_t cnt,
+                          const void *const buffers[]);
+static bool can_dma (struct ata_disk *, size_t cnt,
+                     const void *const buffers[]);
+
 /* Initialize the disk subsystem and detect disks. */
 void
 ide_init (void) 
 {
   size_t chan_no;
+  uint16_t bm_base = find_bus_master ();
+
+  if (bm_base != 0)
+    printf ("ide: bus master DMA at port %#"PRIx16"\n", bm_base);
 
   for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++)
     {
@@ -126,6 +198,8 @@ ide_init (void)
       lock_init (&c->lock);
       c->expecting_interrupt = false;
       sema_init (&c->completion_wait, 0);
+      c->bm_base = bm_base != 0 ? bm_base + chan_no * 8 : 0;
+      c->prdt = bm_base != 0 ? palloc_get_page (PAL_ASSERT) : NULL;
  
       /* Initialize devices. */
       for (dev_no = 0; dev_no < 2; dev_no++)
@@ -136,6 +210,7 @@ ide_init (void)
           d->channel = c;
           d->dev_no = dev_no;
           d->is_ata = false;
+          d->use_dma = false;
         }
 
       /* Register interrupt handler. */
@@ -284,6 +359,7 @@ identify_ata_device (struct ata_disk *d)
   /* Calculate capacity.
      Read model name and serial number. */
   capacity = *(uint32_t *) &id[60 * 2];
+  d->use_dma = c->bm_base != 0 && (*(uint16_t *) &id[49 * 2] & ID_CAP_DMA);
   model = descramble_ata_string (&id[10 * 2], 20);
   serial = descramble_ata_string (&id[27 * 2], 40);
   snprintf (extra_info, sizeof extra_info,
@@ -344,16 +420,7 @@ descramble_ata_string (char *string, int size)
 static void
 ide_read (void *d_, block_sector_t sec_no, void *buffer)
 {
-  struct ata_disk *d = d_;
-  struct channel *c = d->channel;
-  lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_READ_SECTOR_RETRY);
-  sema_down (&c->completion_wait);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no);
-  input_sector (c, buffer);
-  lock_release (&c->lock);
+  ide_read_multiple (d_, sec_no, 1, &buffer);
 }
 
 /* Write sector SEC_NO to disk D from BUFFER, which must contain
@@ -363,37 +430,114 @@ ide_read (void *d_, block_sector_t sec_no, void *buffer)
    per-disk locking is unneeded. */
 static void
 ide_write (void *d_, block_sector_t sec_no, const void *buffer)
+{
+  ide_write_multiple (d_, sec_no, 1, &buffer);
+}
+
+/* Reads the CNT sectors starting at SEC_NO from disk D into
+   BUFFERS, one buffer with room for BLOCK_SECTOR_SIZE bytes per
+   sector.  Each command transfers up to MAX_SECTORS_PER_COMMAND
+   sectors, with the disk interrupting once per sector.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+static void
+ide_read_multiple (void *d_, block_sector_t sec_no, size_t cnt,
+                   void *const buffers[])
 {
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
-  output_sector (c, buffer);
-  sema_down (&c->completion_wait);
+  if (can_dma (d, cnt, (const void *const *) buffers))
+    {
+      dma_transfer (d, sec_no, cnt, (const void *const *) buffers, false);
+      cnt = 0;
+    }
+  while (cnt > 0)
+    {
+      size_t sector_cnt = (cnt < MAX_SECTORS_PER_COMMAND
+                           ? cnt : MAX_SECTORS_PER_COMMAND);
+      size_t i;
+
+      select_sector (d, sec_no, sector_cnt);
+      issue_pio_command (c, CMD_READ_SECTOR_RETRY);
+      for (i = 0; i < sector_cnt; i++)
+        {
+          sema_down (&c->completion_wait);
+          if (!wait_while_busy (d))
+            PANIC ("%s: disk read failed, sector=%"PRDSNu,
+                   d->name, sec_no + i);
+          input_sector (c, buffers[i]);
+        }
+      sec_no += sector_cnt;
+      buffers += sector_cnt;
+      cnt -= sector_cnt;
+    }
+  lock_release (&c->lock);
+}
+
+/* Writes the CNT sectors starting at SEC_NO to disk D from
+   BUFFERS, one buffer of BLOCK_SECTOR_SIZE bytes per sector.
+   Returns after the disk has acknowledged receiving the data.
+   Each command transfers up to MAX_SECTORS_PER_COMMAND sectors,
+   with the disk interrupting once per sector.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+static void
+ide_write_multiple (void *d_, block_sector_t sec_no, size_t cnt,
+                    const void *const buffers[])
+{
+  struct ata_disk *d = d_;
+  struct channel *c = d->channel;
+  lock_acquire (&c->lock);
+  if (can_dma (d, cnt, buffers))
+    {
+      dma_transfer (d, sec_no, cnt, buffers, true);
+      cnt = 0;
+    }
+  while (cnt > 0)
+    {
+      size_t sector_cnt = (cnt < MAX_SECTORS_PER_COMMAND
+                           ? cnt : MAX_SECTORS_PER_COMMAND);
+      size_t i;
+
+      select_sector (d, sec_no, sector_cnt);
+      issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
+      for (i = 0; i < sector_cnt; i++)
+        {
+          if (!wait_while_busy (d))
+            PANIC ("%s: disk write failed, sector=%"PRDSNu,
+                   d->name, sec_no + i);
+          output_sector (c, buffers[i]);
+          sema_down (&c->completion_wait);
+        }
+      sec_no += sector_cnt;
+      buffers += sector_cnt;
+      cnt -= sector_cnt;
+    }
   lock_release (&c->lock);
 }
 
 static struct block_operations ide_operations =
   {
     ide_read,
-    ide_write
+    ide_write,
+    ide_read_multiple,
+    ide_write_multiple
   };
 
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
-   use LBA mode.) */
+   writes SEC_NO to the disk's sector selection registers and CNT
+   to its sector count register.  (We use LBA mode.) */
 static void
-select_sector (struct ata_disk *d, block_sector_t sec_no)
+select_sector (struct ata_disk *d, block_sector_t sec_no, size_t cnt)
 {
   struct channel *c = d->channel;
 
   ASSERT (sec_no < (1UL << 28));
+  ASSERT (cnt > 0 && cnt <= MAX_SECTORS_PER_COMMAND);
   
   select_device_wait (d);
-  outb (reg_nsect (c), 1);
+  outb (reg_nsect (c), cnt == MAX_SECTORS_PER_COMMAND ? 0 : cnt);
   outb (reg_lbal (c), sec_no);
   outb (reg_lbam (c), sec_no >> 8);
   outb (reg_lbah (c), (sec_no >> 16));
@@ -430,6 +574,170 @@ output_sector (struct channel *c, const void *sector)
   outsw (reg_data (c), sector, BLOCK_SECTOR_SIZE / 2);
 }
 
+/* Bus master DMA. */
+
+/* Returns true if disk D can transfer to or from the CNT
+   BUFFERS with DMA.  Only kernel buffers qualify, since only
+   their physical addresses are known; transfers with any user
+   buffer are done with programmed I/O. */
+static bool
+can_dma (struct ata_disk *d, size_t cnt, const void *const buffers[])
+{
+  size_t i;
+
+  if (!d->use_dma)
+    return false;
+  for (i = 0; i < cnt; i++)
+    if (!is_kernel_vaddr (buffers[i]))
+      return false;
+  return true;
+}
+
+/* Transfers the CNT sectors starting at SEC_NO between disk D
+   and BUFFERS, one BLOCK_SECTOR_SIZE buffer per sector, with bus
+   master DMA, writing to the disk if WRITE is true.  Each command
+   transfers up to MAX_SECTORS_PER_COMMAND sectors, and the disk
+   interrupts only once the whole command is done.  D's channel
+   must be locked. */
+static void
+dma_transfer (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+              const void *const buffers[], bool write)
+{
+  struct channel *c = d->channel;
+  uint8_t direction = write ? 0 : BM_CMD_READ;
+
+  ASSERT (lock_held_by_current_thread (&c->lock));
+  while (cnt > 0)
+    {
+      size_t sector_cnt = (cnt < MAX_SECTORS_PER_COMMAND
+                           ? cnt : MAX_SECTORS_PER_COMMAND);
+      uint8_t bm_status, status;
+
+      build_prdt (c, sector_cnt, buffers);
+      outl (reg_bm_prdt (c), vtop (c->prdt));
+      outb (reg_bm_command (c), direction);
+      outb (reg_bm_status (c), BM_STA_ERROR | BM_STA_INTR);
+
+      select_sector (d, sec_no, sector_cnt);
+      issue_pio_command (c, write ? CMD_WRITE_DMA : CMD_READ_DMA);
+      outb (reg_bm_command (c), direction | BM_CMD_START);
+      sema_down (&c->completion_wait);
+      outb (reg_bm_command (c), direction);
+
+      bm_status = inb (reg_bm_status (c));
+      outb (reg_bm_status (c), BM_STA_ERROR | BM_STA_INTR);
+      status = inb (reg_status (c));
+      if ((bm_status & BM_STA_ERROR) || (status & (STA_ERR | STA_DF)))
+        PANIC ("%s: disk DMA %s failed, sector=%"PRDSNu,
+               d->name, write ? "write" : "read", sec_no);
+
+      sec_no += sector_cnt;
+      buffers += sector_cnt;
+      cnt -= sector_cnt;
+    }
+}
+
+/* Fills channel C's physical region descriptor table with the
+   CNT sector buffers in BUFFERS, merging buffers which are
+   contiguous in physical memory, such as the sectors of a page,
+   into one region.  Returns the number of descriptors used. */
+static size_t
+build_prdt (struct channel *c, size_t cnt, const void *const buffers[])
+{
+  struct prd *prd = NULL;
+  size_t prd_cnt = 0;
+  size_t i;
+
+  for (i = 0; i < cnt; i++)
+    {
+      uint32_t addr = vtop (buffers[i]);
+      uint32_t end = addr + BLOCK_SECTOR_SIZE;
+
+      while (addr < end)
+        {
+          /* Regions may not cross a 64 kB boundary. */
+          uint32_t boundary = (addr | 0xffff) + 1;
+          uint32_t len = (end < boundary ? end : boundary) - addr;
+          uint32_t prd_len = (prd == NULL ? 0
+                              : prd->byte_cnt == 0 ? 0x10000
+                              : prd->byte_cnt);
+
+          if (prd != NULL && prd->phys_addr + prd_len == addr
+              && (prd->phys_addr & ~0xffffu) == (addr & ~0xffffu))
+            prd->byte_cnt = prd_len + len;
+          else
+            {
+              ASSERT (prd_cnt < PRD_MAX);
+              prd = &c->prdt[prd_cnt++];
+              prd->phys_addr = addr;
+              prd->byte_cnt = len;
+              prd->flags = 0;
+            }
+          addr += len;
+        }
+    }
+  prd->flags = PRD_EOT;
+  return prd_cnt;
+}
+
+/* Returns the bus master base port of the first IDE controller
+   found on PCI bus 0 that supports bus mastering, enabling bus
+   mastering on it, or 0 if there is none. */
+static uint16_t
+find_bus_master (void)
+{
+  int dev, func;
+
+  for (dev = 0; dev < 32; dev++)
+    for (func = 0; func < 8; func++)
+      {
+        uint32_t class = pci_read_config (0, dev, func, PCI_REG_CLASS);
+        uint32_t bar4, command;
+
+        if (pci_read_config (0, dev, func, 0) == 0xffffffff)
+          {
+            if (func == 0)
+              break;
+            continue;
+          }
+        if ((class >> 16) != PCI_CLASS_IDE)
+          continue;
+
+        /* BAR4 must be an I/O space base. */
+        bar4 = pci_read_config (0, dev, func, PCI_REG_BAR4);
+        if ((bar4 & 1) == 0 || (bar4 & 0xfffc) == 0)
+          continue;
+
+        command = pci_read_config (0, dev, func, PCI_REG_COMMAND);
+        pci_write_config (0, dev, func, PCI_REG_COMMAND,
+                          (command & 0xffff) | PCI_CMD_IO
+                          | PCI_CMD_BUS_MASTER);
+        return bar4 & 0xfffc;
+      }
+  return 0;
+}
+
+/* Returns the 32-bit register REG from the PCI configuration
+   space of function FUNC of device DEV on bus BUS. */
+static uint32_t
+pci_read_config (int bus, int dev, int func, int reg)
+{
+  outl (PCI_CONFIG_ADDRESS, (0x80000000u | (bus << 16) | (dev << 11)
+                             | (func << 8) | (reg & 0xfc)));
+  return inl (PCI_CONFIG_DATA);
+}
+
+/* Writes VALUE to the 32-bit register REG in the PCI
+   configuration space of function FUNC of device DEV on bus
+   BUS. */
+static void
+pci_write_config (int bus, int dev, int func, int reg, uint32_t value)
+{
+  outl (PCI_CONFIG_ADDRESS, (0x80000000u | (bus << 16) | (dev << 11)
+                             | (func << 8) | (reg & 0xfc)));
+  outl (PCI_CONFIG_DATA, value);
+}
+
 /* Low-level ATA primitives. */
 
 /* Wait up to 10 seconds for the controller to become idle, that
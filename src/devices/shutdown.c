@@ -11,8 +11,17 @@
 #endif
 #ifdef FILESYS
 #include "devices/block.h"
+#include "filesys/cache.h"
+#include "filesys/file.h"
+#include "filesys/inode.h"
 #include "filesys/filesys.h"
 #endif
+#ifdef VM
+#include "vm/compressed_swap.h"
+#include "vm/frame.h"
+#include "vm/shared_page.h"
+#include "vm/supp_page.h"
+#endif
 
 /* Keyboard control register port. */
 #define CONTROL_REG 0x64
@@ -123,10 +132,19 @@ print_stats (void)
   thread_print_stats ();
 #ifdef FILESYS
   block_print_stats ();
+  cache_print_stats ();
+  file_print_stats ();
+  inode_print_stats ();
 #endif
   console_print_stats ();
   kbd_print_stats ();
 #ifdef USERPROG
   exception_print_stats ();
 #endif
+#ifdef VM
+  frame_print_stats ();
+  shared_page_print_stats ();
+  supp_page_print_stats ();
+  compressed_swap_print_stats ();
+#endif
 }
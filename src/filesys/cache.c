@@ -0,0 +1,527 @@
+#include "filesys/cache.h"
+#include <debug.h>
+#include <hash.h>
+#include <round.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "filesys/filesys.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+
+/* Maximum number of consecutive sectors written back in one
+   request. */
+#define CACHE_FLUSH_RUN 32
+
+/* Maximum number of sectors waiting to be read ahead. */
+#define CACHE_READAHEAD_QUEUE 64
+
+/* A buffer cache entry, which holds one sector of the file
+   system device.
+
+   An entry is pinned while a thread uses it, which keeps it
+   from being evicted.  A thread pins the entry under the cache
+   lock, then holds the entry's own lock while it reads or
+   writes the entry's data, so that accesses to different
+   sectors do not wait for one another.
+
+   Writes only mark the entry dirty.  Dirty sectors are written
+   back when they are replaced, and periodically by the flusher
+   thread. */
+struct cache_entry
+  {
+    struct hash_elem hash_elem;         /* Element in the cache map. */
+    block_sector_t sector;              /* Sector held, if in use. */
+    bool in_use;                        /* Holds a sector? */
+    bool accessed;                      /* Used since the hand passed? */
+    bool dirty;                         /* Changed since written back? */
+    bool readahead;                     /* Read ahead and not used yet? */
+    int pin_cnt;                        /* Number of threads using it. */
+    struct lock lock;                   /* Protects DATA. */
+    uint8_t *data;                      /* BLOCK_SECTOR_SIZE bytes. */
+  };
+
+/* The buffer cache.  Entries are replaced with the clock
+   algorithm. */
+struct cache
+  {
+    struct lock lock;                   /* Protects all but entry data. */
+    struct condition unpinned;          /* Signalled on unpinning. */
+    struct cache_entry *entries;        /* All entries. */
+    size_t entry_cnt;                   /* Number of entries. */
+    size_t hand;                        /* Clock hand. */
+    struct hash map;                    /* Entries in use, by sector. */
+
+    struct lock flush_lock;             /* Serializes flushes. */
+    struct cache_entry **flush_list;    /* Dirty entries being flushed. */
+  };
+
+/* Buffer cache statistics. */
+struct cache_stats
+  {
+    long long hits;                     /* Sectors found in the cache. */
+    long long misses;                   /* Sectors not in the cache. */
+    long long evictions;                /* Sectors replaced. */
+    long long writebacks;               /* Dirty sectors written back. */
+    long long writes;                   /* Write requests for them. */
+    long long readahead_reads;          /* Sectors read ahead. */
+    long long readahead_used;           /* ...later found by a hit. */
+    long long readahead_cached;         /* Already cached when due. */
+    long long readahead_dropped;        /* Dropped, queue full. */
+  };
+
+/* Sectors waiting for the read-ahead thread, in a ring buffer. */
+struct readahead_queue
+  {
+    struct lock lock;                   /* Protects the members below. */
+    struct condition not_empty;         /* Signalled on queueing. */
+    block_sector_t sectors[CACHE_READAHEAD_QUEUE];
+    size_t start;                       /* Index of the first sector. */
+    size_t cnt;                         /* Number of sectors queued. */
+  };
+
+static struct cache cache;
+static struct cache_stats cache_stats;
+static struct readahead_queue readahead_queue;
+
+static struct cache_entry *cache_get (block_sector_t sector, bool load,
+                                      bool readahead);
+static void cache_put (struct cache_entry *e);
+static void unpin (struct cache_entry *e);
+static void write_back_run (struct cache_entry **run, size_t cnt);
+static int compare_sectors (const void *a, const void *b);
+static void flusher (void *flush_ticks_);
+static void readahead_thread (void *aux UNUSED);
+static struct cache_entry *clock_select_victim (void);
+static unsigned entry_hash (const struct hash_elem *e, void *aux UNUSED);
+static bool entry_less (const struct hash_elem *a, const struct hash_elem *b,
+                        void *aux UNUSED);
+
+/* Initializes the buffer cache to hold SECTOR_CNT sectors, and
+   starts the read-ahead thread and a flusher thread which writes
+   back dirty sectors every FLUSH_TICKS timer ticks.  A
+   FLUSH_TICKS of 0 leaves dirty sectors in the cache until they
+   are replaced or cache_flush() is called. */
+void
+cache_init (size_t sector_cnt, int64_t flush_ticks)
+{
+  static int64_t flusher_ticks;
+  size_t page_cnt;
+  uint8_t *data;
+  size_t i;
+
+  if (sector_cnt == 0)
+    sector_cnt = 1;
+  page_cnt = DIV_ROUND_UP (sector_cnt * BLOCK_SECTOR_SIZE, PGSIZE);
+  data = palloc_get_multiple (PAL_ASSERT, page_cnt);
+  cache.entries = calloc (sector_cnt, sizeof *cache.entries);
+  cache.flush_list = calloc (sector_cnt, sizeof *cache.flush_list);
+  if (cache.entries == NULL || cache.flush_list == NULL)
+    PANIC ("Failed to allocate memory for the buffer cache");
+
+  lock_init (&cache.lock);
+  cond_init (&cache.unpinned);
+  cache.entry_cnt = sector_cnt;
+  cache.hand = 0;
+  hash_init (&cache.map, entry_hash, entry_less, NULL);
+  lock_init (&cache.flush_lock);
+  for (i = 0; i < sector_cnt; i++)
+    {
+      struct cache_entry *e = &cache.entries[i];
+      e->in_use = false;
+      e->accessed = false;
+      e->dirty = false;
+      e->readahead = false;
+      e->pin_cnt = 0;
+      lock_init (&e->lock);
+      e->data = data + i * BLOCK_SECTOR_SIZE;
+    }
+
+  lock_init (&readahead_queue.lock);
+  cond_init (&readahead_queue.not_empty);
+  readahead_queue.start = 0;
+  readahead_queue.cnt = 0;
+  thread_create ("readahead", PRI_DEFAULT, readahead_thread, NULL);
+
+  if (flush_ticks > 0)
+    {
+      flusher_ticks = flush_ticks;
+      thread_create ("flusher", PRI_DEFAULT, flusher, &flusher_ticks);
+    }
+}
+
+/* Copies SIZE bytes at offset OFS within file system sector
+   SECTOR into BUFFER, reading the sector into the cache if it is
+   not there yet. */
+void
+cache_read (block_sector_t sector, void *buffer, size_t ofs, size_t size)
+{
+  struct cache_entry *e;
+
+  ASSERT (ofs + size <= BLOCK_SECTOR_SIZE);
+  if (is_user_vaddr (buffer))
+    {
+      /* Touching user memory may fault, and resolving the fault
+         may need other entries, so never do it under an entry's
+         lock. */
+      uint8_t bounce[BLOCK_SECTOR_SIZE];
+      cache_read (sector, bounce, ofs, size);
+      memcpy (buffer, bounce, size);
+      return;
+    }
+
+  e = cache_get (sector, true, false);
+  memcpy (buffer, e->data + ofs, size);
+  cache_put (e);
+}
+
+/* Copies SIZE bytes from BUFFER to offset OFS within file
+   system sector SECTOR in the cache, to be written back later.
+   The rest of the sector is read in first, unless the whole
+   sector is written. */
+void
+cache_write (block_sector_t sector, const void *buffer, size_t ofs,
+             size_t size)
+{
+  struct cache_entry *e;
+
+  ASSERT (ofs + size <= BLOCK_SECTOR_SIZE);
+  if (is_user_vaddr (buffer))
+    {
+      /* See cache_read(). */
+      uint8_t bounce[BLOCK_SECTOR_SIZE];
+      memcpy (bounce, buffer, size);
+      cache_write (sector, bounce, ofs, size);
+      return;
+    }
+
+  e = cache_get (sector, size < BLOCK_SECTOR_SIZE, false);
+  memcpy (e->data + ofs, buffer, size);
+  e->dirty = true;
+  cache_put (e);
+}
+
+/* Writes every dirty sector in the cache back to disk, in
+   ascending sector order, merging consecutive sectors into
+   single requests. */
+void
+cache_flush (void)
+{
+  struct cache_entry **list = cache.flush_list;
+  size_t cnt = 0;
+  size_t i;
+
+  lock_acquire (&cache.flush_lock);
+
+  /* Pin the dirty entries, so that they keep their sectors. */
+  lock_acquire (&cache.lock);
+  for (i = 0; i < cache.entry_cnt; i++)
+    {
+      struct cache_entry *e = &cache.entries[i];
+      if (e->in_use && e->dirty)
+        {
+          e->pin_cnt++;
+          list[cnt++] = e;
+        }
+    }
+  lock_release (&cache.lock);
+
+  qsort (list, cnt, sizeof *list, compare_sectors);
+  i = 0;
+  while (i < cnt)
+    {
+      /* Lock a run of consecutive sectors, in ascending order. */
+      size_t run = 0;
+      size_t j;
+
+      while (i + run < cnt && run < CACHE_FLUSH_RUN
+             && list[i + run]->sector == list[i]->sector + run)
+        lock_acquire (&list[i + run++]->lock);
+      write_back_run (list + i, run);
+      for (j = 0; j < run; j++)
+        lock_release (&list[i + j]->lock);
+      i += run;
+    }
+
+  lock_acquire (&cache.lock);
+  for (i = 0; i < cnt; i++)
+    unpin (list[i]);
+  lock_release (&cache.lock);
+
+  lock_release (&cache.flush_lock);
+}
+
+/* Queues SECTOR to be read into the cache in the background, if
+   there is room in the read-ahead queue. */
+void
+cache_readahead (block_sector_t sector)
+{
+  struct readahead_queue *q = &readahead_queue;
+
+  lock_acquire (&q->lock);
+  if (q->cnt < CACHE_READAHEAD_QUEUE)
+    {
+      q->sectors[(q->start + q->cnt++) % CACHE_READAHEAD_QUEUE] = sector;
+      cond_signal (&q->not_empty, &q->lock);
+    }
+  else
+    cache_stats.readahead_dropped++;
+  lock_release (&q->lock);
+}
+
+/* Prints buffer cache statistics. */
+void
+cache_print_stats (void)
+{
+  printf ("Buffer cache: %lld hits, %lld misses, %lld evictions\n",
+          cache_stats.hits, cache_stats.misses, cache_stats.evictions);
+  printf ("Buffer cache: %lld sectors written back in %lld writes\n",
+          cache_stats.writebacks, cache_stats.writes);
+  printf ("Buffer cache: %lld sectors read ahead (%lld used), "
+          "%lld already cached, %lld dropped\n",
+          cache_stats.readahead_reads, cache_stats.readahead_used,
+          cache_stats.readahead_cached, cache_stats.readahead_dropped);
+}
+
+/* Returns the pinned and locked entry holding SECTOR, replacing
+   another sector if SECTOR is not in the cache.  A newly cached
+   sector is read from disk if LOAD is true, and otherwise left
+   for the caller to overwrite.
+   READAHEAD is true for the read-ahead thread, which has no use
+   for a sector that is already cached: a null pointer is then
+   returned instead. */
+static struct cache_entry *
+cache_get (block_sector_t sector, bool load, bool readahead)
+{
+  struct cache_entry key;
+  struct cache_entry *e;
+
+  lock_acquire (&cache.lock);
+  key.sector = sector;
+  for (;;)
+    {
+      struct hash_elem *found = hash_find (&cache.map, &key.hash_elem);
+      if (found != NULL)
+        {
+          e = hash_entry (found, struct cache_entry, hash_elem);
+          if (readahead)
+            {
+              cache_stats.readahead_cached++;
+              lock_release (&cache.lock);
+              return NULL;
+            }
+          e->pin_cnt++;
+          e->accessed = true;
+          cache_stats.hits++;
+          if (e->readahead)
+            {
+              e->readahead = false;
+              cache_stats.readahead_used++;
+            }
+          lock_release (&cache.lock);
+
+          /* Waits for the data if the sector is still being read. */
+          lock_acquire (&e->lock);
+          return e;
+        }
+
+      e = clock_select_victim ();
+      if (e != NULL && e->dirty)
+        {
+          /* Write the victim back before replacing it.  It stays
+             in the map meanwhile, so that readers of its sector
+             wait for it instead of reading stale data from disk. */
+          e->pin_cnt++;
+          lock_acquire (&e->lock);
+          lock_release (&cache.lock);
+          write_back_run (&e, 1);
+          lock_release (&e->lock);
+          lock_acquire (&cache.lock);
+          unpin (e);
+          continue;
+        }
+      if (e != NULL)
+        break;
+
+      /* Every entry is in use; the sector may have been cached
+         by the time one is unpinned. */
+      cond_wait (&cache.unpinned, &cache.lock);
+    }
+
+  if (readahead)
+    cache_stats.readahead_reads++;
+  else
+    cache_stats.misses++;
+  if (e->in_use)
+    {
+      hash_delete (&cache.map, &e->hash_elem);
+      cache_stats.evictions++;
+    }
+  e->sector = sector;
+  e->in_use = true;
+  e->accessed = true;
+  e->readahead = readahead;
+  e->pin_cnt = 1;
+  hash_insert (&cache.map, &e->hash_elem);
+
+  /* Nobody holds the lock of an unpinned entry. */
+  lock_acquire (&e->lock);
+  lock_release (&cache.lock);
+
+  if (load)
+    block_read (fs_device, sector, e->data);
+  return e;
+}
+
+/* Unlocks and unpins entry E. */
+static void
+cache_put (struct cache_entry *e)
+{
+  lock_release (&e->lock);
+  lock_acquire (&cache.lock);
+  unpin (e);
+  lock_release (&cache.lock);
+}
+
+/* Unpins entry E.  The cache lock must be held. */
+static void
+unpin (struct cache_entry *e)
+{
+  ASSERT (lock_held_by_current_thread (&cache.lock));
+  if (--e->pin_cnt == 0)
+    cond_signal (&cache.unpinned, &cache.lock);
+}
+
+/* Writes back the dirty entries among the CNT entries in RUN,
+   which hold consecutive sectors and are locked, with one
+   request for each stretch of dirty entries.  The cache lock
+   must not be held. */
+static void
+write_back_run (struct cache_entry **run, size_t cnt)
+{
+  size_t i = 0;
+
+  while (i < cnt)
+    {
+      const void *buffers[CACHE_FLUSH_RUN];
+      size_t dirty_cnt = 0;
+
+      /* Another thread may have written an entry back since it
+         was chosen. */
+      while (i + dirty_cnt < cnt && run[i + dirty_cnt]->dirty)
+        {
+          buffers[dirty_cnt] = run[i + dirty_cnt]->data;
+          run[i + dirty_cnt]->dirty = false;
+          dirty_cnt++;
+        }
+      if (dirty_cnt > 0)
+        {
+          block_write_multiple (fs_device, run[i]->sector, dirty_cnt,
+                                buffers);
+          lock_acquire (&cache.lock);
+          cache_stats.writebacks += dirty_cnt;
+          cache_stats.writes++;
+          lock_release (&cache.lock);
+          i += dirty_cnt;
+        }
+      else
+        i++;
+    }
+}
+
+/* Orders two entries by the sectors they hold, for qsort(). */
+static int
+compare_sectors (const void *a_, const void *b_)
+{
+  const struct cache_entry *a = *(struct cache_entry *const *) a_;
+  const struct cache_entry *b = *(struct cache_entry *const *) b_;
+
+  return a->sector < b->sector ? -1 : a->sector > b->sector;
+}
+
+/* Writes back the cache's dirty sectors every *FLUSH_TICKS_
+   timer ticks, behind the I/O that processes wait for. */
+static void
+flusher (void *flush_ticks_)
+{
+  int64_t flush_ticks = *(int64_t *) flush_ticks_;
+
+  block_set_io_class (BLOCK_IO_BACKGROUND);
+  for (;;)
+    {
+      timer_sleep (flush_ticks);
+      cache_flush ();
+    }
+}
+
+/* Advances the clock hand to the next entry to replace: an
+   unused entry, or else an entry which has not been accessed
+   since the hand last passed it.  Pinned entries are skipped.
+   Returns a null pointer if every entry is pinned.
+   The cache lock must be held. */
+static struct cache_entry *
+clock_select_victim (void)
+{
+  size_t i;
+
+  ASSERT (lock_held_by_current_thread (&cache.lock));
+  for (i = 0; i < 2 * cache.entry_cnt; i++)
+    {
+      struct cache_entry *e = &cache.entries[cache.hand];
+      cache.hand = (cache.hand + 1) % cache.entry_cnt;
+
+      if (e->pin_cnt > 0)
+        continue;
+      if (!e->in_use || !e->accessed)
+        return e;
+      e->accessed = false;
+    }
+  return NULL;
+}
+
+/* Returns a hash of the sector held by entry E. */
+static unsigned
+entry_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct cache_entry *entry = hash_entry (e, struct cache_entry,
+                                                hash_elem);
+  return hash_int (entry->sector);
+}
+
+/* Returns true if entry A holds a lower sector than entry B. */
+static bool
+entry_less (const struct hash_elem *a, const struct hash_elem *b,
+            void *aux UNUSED)
+{
+  return (hash_entry (a, struct cache_entry, hash_elem)->sector
+          < hash_entry (b, struct cache_entry, hash_elem)->sector);
+}
+
+/* Reads the sectors queued by cache_readahead() into the cache,
+   so that sequential readers find them there. */
+static void
+readahead_thread (void *aux UNUSED)
+{
+  struct readahead_queue *q = &readahead_queue;
+
+  for (;;)
+    {
+      block_sector_t sector;
+      struct cache_entry *e;
+
+      lock_acquire (&q->lock);
+      while (q->cnt == 0)
+        cond_wait (&q->not_empty, &q->lock);
+      sector = q->sectors[q->start];
+      q->start = (q->start + 1) % CACHE_READAHEAD_QUEUE;
+      q->cnt--;
+      lock_release (&q->lock);
+
+      e = cache_get (sector, true, true);
+      if (e != NULL)
+        cache_put (e);
+    }
+}
@@ -0,0 +1,23 @@
+#ifndef FILESYS_CACHE_H
+#define FILESYS_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "devices/block.h"
+#include "devices/timer.h"
+
+/* Default number of file system sectors kept in the buffer cache. */
+#define CACHE_SECTORS 64
+
+/* Default number of timer ticks between writes of dirty sectors. */
+#define CACHE_FLUSH_TICKS (5 * TIMER_FREQ)
+
+void cache_init (size_t sector_cnt, int64_t flush_ticks);
+void cache_flush (void);
+void cache_readahead (block_sector_t);
+void cache_read (block_sector_t, void *buffer, size_t ofs, size_t size);
+void cache_write (block_sector_t, const void *buffer, size_t ofs,
+                  size_t size);
+void cache_print_stats (void);
+
+#endif /* filesys/cache.h */
@@ -1,7 +1,15 @@
 #include "filesys/file.h"
 #include <debug.h>
+#include <round.h>
+#include <stdio.h>
 #include "filesys/inode.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
+
+/* Smallest and largest number of sectors read ahead of a
+   sequential reader. */
+#define READAHEAD_MIN_SECTORS 4
+#define READAHEAD_MAX_SECTORS 32
 
 /* An open file. */
 struct file 
@@ -9,8 +17,36 @@ struct file
     struct inode *inode;        /* File's inode. */
     off_t pos;                  /* Current position. */
     bool deny_write;            /* Has file_deny_write() been called? */
+
+    /* Read-ahead.  A read that starts where the last read ended is
+       sequential, and doubles the window of sectors read ahead of
+       the reader; any other read closes the window. */
+    off_t last_end;             /* End of the last read. */
+    off_t ra_end;               /* End of the data read ahead. */
+    size_t ra_window;           /* Sectors to read ahead, 0 if none. */
   };
 
+/* Read-ahead statistics. */
+struct readahead_stats
+  {
+    long long sequential;       /* Number of sequential reads. */
+    long long windows;          /* Number of times read ahead. */
+    long long sectors;          /* Sectors queued for read-ahead. */
+    size_t max_window;          /* Largest window reached. */
+    struct lock lock;           /* Protects the members above. */
+  };
+
+static struct readahead_stats readahead_stats;
+
+static void readahead (struct file *);
+
+/* Initializes the file module. */
+void
+file_init (void)
+{
+  lock_init (&readahead_stats.lock);
+}
+
 /* Opens a file for the given INODE, of which it takes ownership,
    and returns the new file.  Returns a null pointer if an
    allocation fails or if INODE is null. */
@@ -23,6 +59,9 @@ file_open (struct inode *inode)
       file->inode = inode;
       file->pos = 0;
       file->deny_write = false;
+      file->last_end = 0;
+      file->ra_end = 0;
+      file->ra_window = 0;
       return file;
     }
   else
@@ -64,12 +103,32 @@ file_get_inode (struct file *file)
    starting at the file's current position.
    Returns the number of bytes actually read,
    which may be less than SIZE if end of file is reached.
-   Advances FILE's position by the number of bytes read. */
+   Advances FILE's position by the number of bytes read.
+   Sequential reads have the sectors after them read ahead. */
 off_t
 file_read (struct file *file, void *buffer, off_t size) 
 {
+  bool sequential = file->pos == file->last_end;
   off_t bytes_read = inode_read_at (file->inode, buffer, size, file->pos);
   file->pos += bytes_read;
+  file->last_end = file->pos;
+
+  if (!sequential)
+    {
+      file->ra_end = 0;
+      file->ra_window = 0;
+    }
+  else if (bytes_read > 0)
+    {
+      lock_acquire (&readahead_stats.lock);
+      readahead_stats.sequential++;
+      lock_release (&readahead_stats.lock);
+      if (file->ra_window == 0)
+        file->ra_window = READAHEAD_MIN_SECTORS;
+      else if (file->ra_window < READAHEAD_MAX_SECTORS)
+        file->ra_window *= 2;
+      readahead (file);
+    }
   return bytes_read;
 }
 
@@ -158,6 +217,42 @@ file_seek (struct file *file, off_t new_pos)
   file->pos = new_pos;
 }
 
+/* Prints read-ahead statistics. */
+void
+file_print_stats (void)
+{
+  printf ("Read-ahead: %lld sequential reads, %lld windows of %lld "
+          "sectors, largest window %zu\n",
+          readahead_stats.sequential, readahead_stats.windows,
+          readahead_stats.sectors, readahead_stats.max_window);
+}
+
+/* Queues the sectors in FILE's read-ahead window after its
+   position which have not been read ahead yet. */
+static void
+readahead (struct file *file)
+{
+  off_t start = file->pos > file->ra_end ? file->pos : file->ra_end;
+  off_t end = file->pos + (off_t) file->ra_window * BLOCK_SECTOR_SIZE;
+  off_t length = inode_length (file->inode);
+
+  if (end > length)
+    end = length;
+  if (start >= end)
+    return;
+
+  inode_readahead (file->inode, end - start, start);
+  file->ra_end = end;
+
+  lock_acquire (&readahead_stats.lock);
+  readahead_stats.windows++;
+  readahead_stats.sectors += DIV_ROUND_UP (end, BLOCK_SECTOR_SIZE)
+                             - start / BLOCK_SECTOR_SIZE;
+  if (file->ra_window > readahead_stats.max_window)
+    readahead_stats.max_window = file->ra_window;
+  lock_release (&readahead_stats.lock);
+}
+
 /* Returns the current position in FILE as a byte offset from the
    start of the file. */
 off_t
@@ -4,9 +4,11 @@
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "threads/synch.h"
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per sector. */
+static struct lock free_map_lock;    /* Protects the free map. */
 
 /* Initializes the free map. */
 void
@@ -15,6 +17,7 @@ free_map_init (void)
   free_map = bitmap_create (block_size (fs_device));
   if (free_map == NULL)
     PANIC ("bitmap creation failed--file system device is too large");
+  lock_init (&free_map_lock);
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
 }
@@ -27,7 +30,10 @@ free_map_init (void)
 bool
 free_map_allocate (size_t cnt, block_sector_t *sectorp)
 {
-  block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
+  block_sector_t sector;
+
+  lock_acquire (&free_map_lock);
+  sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
   if (sector != BITMAP_ERROR
       && free_map_file != NULL
       && !bitmap_write (free_map, free_map_file))
@@ -35,18 +41,70 @@ free_map_allocate (size_t cnt, block_sector_t *sectorp)
       bitmap_set_multiple (free_map, sector, cnt, false); 
       sector = BITMAP_ERROR;
     }
+  lock_release (&free_map_lock);
   if (sector != BITMAP_ERROR)
     *sectorp = sector;
   return sector != BITMAP_ERROR;
 }
 
+/* Allocates up to CNT consecutive sectors from the free map and
+   stores the first into *SECTORP.  Takes the free sectors
+   starting at GOAL if GOAL is free, otherwise the first CNT free
+   consecutive sectors after GOAL or, failing that, anywhere,
+   otherwise the first free sector and the free ones after it.
+   Returns the number of sectors allocated, which is 0 if the
+   disk is full or if the free_map file could not be written. */
+size_t
+free_map_allocate_run (size_t cnt, block_sector_t goal,
+                       block_sector_t *sectorp)
+{
+  size_t sector_cnt = bitmap_size (free_map);
+  size_t sector;
+  size_t n = 0;
+
+  ASSERT (cnt > 0);
+
+  if (goal >= sector_cnt)
+    goal = 0;
+
+  lock_acquire (&free_map_lock);
+  if (!bitmap_test (free_map, goal))
+    sector = goal;
+  else
+    {
+      sector = bitmap_scan (free_map, goal, cnt, false);
+      if (sector == BITMAP_ERROR)
+        sector = bitmap_scan (free_map, 0, cnt, false);
+      if (sector == BITMAP_ERROR)
+        sector = bitmap_scan (free_map, 0, 1, false);
+    }
+  if (sector != BITMAP_ERROR)
+    {
+      while (n < cnt && sector + n < sector_cnt
+             && !bitmap_test (free_map, sector + n))
+        n++;
+      bitmap_set_multiple (free_map, sector, n, true);
+      if (free_map_file != NULL && !bitmap_write (free_map, free_map_file))
+        {
+          bitmap_set_multiple (free_map, sector, n, false);
+          n = 0;
+        }
+    }
+  lock_release (&free_map_lock);
+  if (n > 0)
+    *sectorp = sector;
+  return n;
+}
+
 /* Makes CNT sectors starting at SECTOR available for use. */
 void
 free_map_release (block_sector_t sector, size_t cnt)
 {
+  lock_acquire (&free_map_lock);
   ASSERT (bitmap_all (free_map, sector, cnt));
   bitmap_set_multiple (free_map, sector, cnt, false);
   bitmap_write (free_map, free_map_file);
+  lock_release (&free_map_lock);
 }
 
 /* Opens the free map file and reads it from disk. */
@@ -1,23 +1,74 @@
 #include "filesys/inode.h"
+#include <hash.h>
 #include <list.h>
 #include <debug.h>
 #include <round.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <string.h>
+#include "filesys/cache.h"
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
 
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
 
+/* Number of inodes kept in memory after their last opener has
+   closed them, so that reopening them needs no disk read. */
+#define INODE_RETAIN_CNT 32
+
+/* Number of extents in an on-disk inode and in an indirect
+   extent block. */
+#define INODE_EXTENT_CNT 61
+#define INDIRECT_EXTENT_CNT 63
+
+/* Most sectors allocated past the end of a growing file, so that
+   it keeps growing into a contiguous run. */
+#define INODE_PREALLOC_SECTORS 16
+
+/* A run of consecutive data sectors. */
+struct inode_extent
+  {
+    block_sector_t start;               /* First sector. */
+    uint32_t length;                    /* Number of sectors. */
+  };
+
 /* On-disk inode.
-   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+   Must be exactly BLOCK_SECTOR_SIZE bytes long.
+
+   The data sectors are described by a list of extents in file
+   order.  The first INODE_EXTENT_CNT are stored in the inode
+   itself, the rest in a chain of indirect extent blocks.  A file
+   may have more sectors allocated than its length requires while
+   it grows; they are released when it is closed. */
 struct inode_disk
   {
-    block_sector_t start;               /* First data sector. */
     off_t length;                       /* File size in bytes. */
+    uint32_t sector_cnt;                /* Number of data sectors. */
+    uint32_t extent_cnt;                /* Number of extents. */
+    block_sector_t indirect;            /* First indirect block, or 0. */
     unsigned magic;                     /* Magic number. */
-    uint32_t unused[125];               /* Not used. */
+    uint32_t unused;                    /* Not used. */
+    struct inode_extent extents[INODE_EXTENT_CNT]; /* First extents. */
+  };
+
+/* Indirect extent block.
+   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct indirect_block
+  {
+    block_sector_t next;                /* Next indirect block, or 0. */
+    uint32_t unused;                    /* Not used. */
+    struct inode_extent extents[INDIRECT_EXTENT_CNT]; /* Extents. */
+  };
+
+/* An extent in an inode's in-memory extent map. */
+struct extent
+  {
+    block_sector_t ofs;                 /* First file sector it holds. */
+    block_sector_t start;               /* First disk sector. */
+    block_sector_t length;              /* Number of sectors. */
   };
 
 /* Returns the number of sectors to allocate for an inode SIZE
@@ -28,40 +79,390 @@ bytes_to_sectors (off_t size)
   return DIV_ROUND_UP (size, BLOCK_SECTOR_SIZE);
 }
 
-/* In-memory inode. */
+/* In-memory inode.
+
+   ELEM, LRU_ELEM, OPEN_CNT, LOADING and CLOSING are protected by
+   the inode table's lock.
+   The other mutable members are protected by RWLOCK.  Apart from
+   while sectors are allocated to the inode, it is held only
+   while those members are used, never across
+   data I/O or accesses to user memory: the contents of the data
+   sectors are protected sector by sector by the buffer cache.
+
+   EXTENTS holds every extent of the inode, with the file offset
+   of each, so that looking up a sector needs no disk access.
+   EXTENT_HINT is only a hint, which lookups update while holding
+   RWLOCK for reading. */
 struct inode 
   {
-    struct list_elem elem;              /* Element in inode list. */
+    struct hash_elem elem;              /* Element in inode table. */
+    struct list_elem lru_elem;          /* Element in retained list. */
     block_sector_t sector;              /* Sector number of disk location. */
     int open_cnt;                       /* Number of openers. */
+    bool loading;                       /* Being read in. */
+    bool closing;                       /* See inode_close(). */
     bool removed;                       /* True if deleted, false otherwise. */
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
     struct inode_disk data;             /* Inode content. */
+    struct extent *extents;             /* Extent map, in file order. */
+    size_t extent_cap;                  /* Number of slots in EXTENTS. */
+    size_t extent_hint;                 /* Extent of the last lookup. */
+    struct rwlock rwlock;               /* Protects the members above. */
+    struct lock lock;                   /* See inode_lock(). */
   };
 
+/* Returns true if INODE's extent number IDX exists and holds
+   file sector SECTOR. */
+static bool
+extent_contains (const struct inode *inode, size_t idx, size_t sector)
+{
+  const struct extent *e = &inode->extents[idx];
+  return (idx < inode->data.extent_cnt
+          && sector >= e->ofs && sector - e->ofs < e->length);
+}
+
 /* Returns the block device sector that contains byte offset POS
    within INODE.
    Returns -1 if INODE does not contain data for a byte at offset
-   POS. */
+   POS.
+   INODE's rwlock must be held. */
 static block_sector_t
-byte_to_sector (const struct inode *inode, off_t pos) 
+byte_to_sector (struct inode *inode, off_t pos) 
 {
+  size_t sector = pos / BLOCK_SECTOR_SIZE;
+  size_t idx;
+
   ASSERT (inode != NULL);
-  if (pos < inode->data.length)
-    return inode->data.start + pos / BLOCK_SECTOR_SIZE;
-  else
+  if (pos < 0 || sector >= inode->data.sector_cnt)
     return -1;
+
+  /* Sequential access stays within the extent of the last lookup
+     or moves on to the next one.  Otherwise, search for the last
+     extent that starts at or before SECTOR. */
+  idx = inode->extent_hint;
+  if (!extent_contains (inode, idx, sector)
+      && !extent_contains (inode, ++idx, sector))
+    {
+      size_t lo = 0;
+      size_t hi = inode->data.extent_cnt;
+      while (hi - lo > 1)
+        {
+          size_t mid = (lo + hi) / 2;
+          if (inode->extents[mid].ofs <= sector)
+            lo = mid;
+          else
+            hi = mid;
+        }
+      idx = lo;
+    }
+  inode->extent_hint = idx;
+  return inode->extents[idx].start + (sector - inode->extents[idx].ofs);
+}
+
+/* Returns the number of indirect blocks needed to hold
+   EXTENT_CNT extents. */
+static size_t
+indirect_block_cnt (size_t extent_cnt)
+{
+  if (extent_cnt <= INODE_EXTENT_CNT)
+    return 0;
+  return DIV_ROUND_UP (extent_cnt - INODE_EXTENT_CNT, INDIRECT_EXTENT_CNT);
+}
+
+/* Returns the sector of INODE's indirect block number IDX. */
+static block_sector_t
+indirect_sector (struct inode *inode, size_t idx)
+{
+  block_sector_t sector = inode->data.indirect;
+
+  for (; idx > 0; idx--)
+    cache_read (sector, &sector, offsetof (struct indirect_block, next),
+                sizeof sector);
+  return sector;
+}
+
+/* Reads the extents of INODE, whose on-disk inode is in
+   INODE->data, into its extent map.
+   Returns false if memory allocation fails. */
+static bool
+extent_map_load (struct inode *inode)
+{
+  struct inode_disk *d = &inode->data;
+  struct indirect_block *block = NULL;
+  block_sector_t indirect = d->indirect;
+  block_sector_t ofs = 0;
+  size_t i;
+
+  inode->extents = NULL;
+  inode->extent_cap = 0;
+  inode->extent_hint = 0;
+  if (d->extent_cnt == 0)
+    return true;
+
+  inode->extents = malloc (d->extent_cnt * sizeof *inode->extents);
+  if (d->extent_cnt > INODE_EXTENT_CNT)
+    block = malloc (sizeof *block);
+  if (inode->extents == NULL
+      || (d->extent_cnt > INODE_EXTENT_CNT && block == NULL))
+    {
+      free (inode->extents);
+      free (block);
+      inode->extents = NULL;
+      return false;
+    }
+  inode->extent_cap = d->extent_cnt;
+
+  for (i = 0; i < d->extent_cnt; i++)
+    {
+      const struct inode_extent *ext;
+
+      if (i < INODE_EXTENT_CNT)
+        ext = &d->extents[i];
+      else
+        {
+          size_t slot = (i - INODE_EXTENT_CNT) % INDIRECT_EXTENT_CNT;
+          if (slot == 0)
+            {
+              cache_read (indirect, block, 0, BLOCK_SECTOR_SIZE);
+              indirect = block->next;
+            }
+          ext = &block->extents[slot];
+        }
+      inode->extents[i].ofs = ofs;
+      inode->extents[i].start = ext->start;
+      inode->extents[i].length = ext->length;
+      ofs += ext->length;
+    }
+  free (block);
+  return true;
+}
+
+/* Stores extent IDX of INODE's extent map into its on-disk
+   inode, or into the indirect block that holds it.  The caller
+   writes the on-disk inode. */
+static void
+extent_store (struct inode *inode, size_t idx)
+{
+  struct inode_extent ext;
+
+  ext.start = inode->extents[idx].start;
+  ext.length = inode->extents[idx].length;
+  if (idx < INODE_EXTENT_CNT)
+    inode->data.extents[idx] = ext;
+  else
+    {
+      idx -= INODE_EXTENT_CNT;
+      cache_write (indirect_sector (inode, idx / INDIRECT_EXTENT_CNT), &ext,
+                   (offsetof (struct indirect_block, extents)
+                    + idx % INDIRECT_EXTENT_CNT * sizeof ext),
+                   sizeof ext);
+    }
+}
+
+/* Appends the CNT sectors starting at START to INODE's data,
+   merging them into its last extent if they follow it on disk.
+   Returns false if memory or an indirect block could not be
+   allocated. */
+static bool
+extent_append (struct inode *inode, block_sector_t start, size_t cnt)
+{
+  struct inode_disk *d = &inode->data;
+  size_t idx = d->extent_cnt;
+  struct extent *e;
+
+  if (idx > 0)
+    {
+      e = &inode->extents[idx - 1];
+      if (e->start + e->length == start)
+        {
+          e->length += cnt;
+          d->sector_cnt += cnt;
+          extent_store (inode, idx - 1);
+          return true;
+        }
+    }
+
+  if (idx == inode->extent_cap)
+    {
+      size_t cap = idx > 0 ? 2 * idx : 8;
+      struct extent *extents = realloc (inode->extents,
+                                        cap * sizeof *extents);
+      if (extents == NULL)
+        return false;
+      inode->extents = extents;
+      inode->extent_cap = cap;
+    }
+
+  if (indirect_block_cnt (idx + 1) > indirect_block_cnt (idx))
+    {
+      static const struct indirect_block empty;
+      size_t block_idx = indirect_block_cnt (idx);
+      block_sector_t sector;
+
+      if (!free_map_allocate (1, &sector))
+        return false;
+      cache_write (sector, &empty, 0, BLOCK_SECTOR_SIZE);
+      if (block_idx == 0)
+        d->indirect = sector;
+      else
+        cache_write (indirect_sector (inode, block_idx - 1), &sector,
+                     offsetof (struct indirect_block, next), sizeof sector);
+    }
+
+  e = &inode->extents[idx];
+  e->ofs = d->sector_cnt;
+  e->start = start;
+  e->length = cnt;
+  d->extent_cnt++;
+  d->sector_cnt += cnt;
+  extent_store (inode, idx);
+  return true;
+}
+
+/* Extends INODE's data to at least SECTOR_CNT sectors, zeroing
+   the new sectors.  If PREALLOC is true, also allocates as many
+   sectors again as INODE already has, up to
+   INODE_PREALLOC_SECTORS, if they are available.
+   Returns false if the disk or memory is exhausted, in which case
+   INODE may have grown partway.
+   INODE's rwlock must be held for writing, unless INODE is not
+   yet visible to other threads. */
+static bool
+inode_grow (struct inode *inode, size_t sector_cnt, bool prealloc)
+{
+  static const char zeros[BLOCK_SECTOR_SIZE];
+  struct inode_disk *d = &inode->data;
+  size_t old_cnt = d->sector_cnt;
+  size_t target = sector_cnt;
+
+  if (old_cnt >= sector_cnt)
+    return true;
+  if (prealloc)
+    target += old_cnt < INODE_PREALLOC_SECTORS ? old_cnt
+                                                : INODE_PREALLOC_SECTORS;
+
+  while (d->sector_cnt < target)
+    {
+      block_sector_t goal, start;
+      size_t cnt, i;
+
+      /* Try to continue the last extent. */
+      if (d->extent_cnt > 0)
+        {
+          struct extent *last = &inode->extents[d->extent_cnt - 1];
+          goal = last->start + last->length;
+        }
+      else
+        goal = inode->sector + 1;
+
+      cnt = free_map_allocate_run (target - d->sector_cnt, goal, &start);
+      if (cnt == 0)
+        break;
+      if (!extent_append (inode, start, cnt))
+        {
+          free_map_release (start, cnt);
+          break;
+        }
+      for (i = 0; i < cnt; i++)
+        cache_write (start + i, zeros, 0, BLOCK_SECTOR_SIZE);
+    }
+
+  if (d->sector_cnt != old_cnt)
+    cache_write (inode->sector, d, 0, BLOCK_SECTOR_SIZE);
+  return d->sector_cnt >= sector_cnt;
+}
+
+/* Releases INODE's data sectors past the first SECTOR_CNT, along
+   with the indirect blocks that no longer hold extents.
+   INODE must not be in use by any other thread. */
+static void
+inode_shrink (struct inode *inode, size_t sector_cnt)
+{
+  struct inode_disk *d = &inode->data;
+  size_t old_block_cnt, block_cnt;
+
+  if (d->sector_cnt <= sector_cnt)
+    return;
+
+  old_block_cnt = indirect_block_cnt (d->extent_cnt);
+  while (d->sector_cnt > sector_cnt)
+    {
+      struct extent *e = &inode->extents[d->extent_cnt - 1];
+      size_t cnt = d->sector_cnt - sector_cnt;
+
+      if (cnt > e->length)
+        cnt = e->length;
+      free_map_release (e->start + e->length - cnt, cnt);
+      e->length -= cnt;
+      d->sector_cnt -= cnt;
+      if (e->length == 0)
+        d->extent_cnt--;
+    }
+
+  block_cnt = indirect_block_cnt (d->extent_cnt);
+  if (block_cnt < old_block_cnt)
+    {
+      static const block_sector_t none = 0;
+      block_sector_t sector = indirect_sector (inode, block_cnt);
+
+      if (block_cnt == 0)
+        d->indirect = 0;
+      else
+        cache_write (indirect_sector (inode, block_cnt - 1), &none,
+                     offsetof (struct indirect_block, next), sizeof none);
+      while (sector != 0)
+        {
+          block_sector_t next;
+
+          cache_read (sector, &next, offsetof (struct indirect_block, next),
+                      sizeof next);
+          free_map_release (sector, 1);
+          sector = next;
+        }
+    }
+
+  if (d->extent_cnt > 0)
+    extent_store (inode, d->extent_cnt - 1);
+  cache_write (inode->sector, d, 0, BLOCK_SECTOR_SIZE);
 }
 
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
-static struct list open_inodes;
+/* Table of in-memory inodes by sector, so that opening a single
+   inode twice returns the same `struct inode'.  Besides the open
+   inodes, it keeps up to INODE_RETAIN_CNT closed inodes, which are
+   also on the RETAINED list, least recently closed first. */
+struct inode_table
+  {
+    struct lock lock;                   /* Protects the members below. */
+    struct hash inodes;                 /* In-memory inodes, by sector. */
+    struct list retained;               /* Closed inodes, LRU order. */
+    size_t retained_cnt;                /* Number of closed inodes. */
+    struct condition ready;             /* See inode_open(). */
+  };
+
+/* Inode table statistics. */
+struct inode_stats
+  {
+    long long open_hits;                /* Opens of an open inode. */
+    long long retained_hits;            /* Opens of a retained inode. */
+    long long misses;                   /* Opens reading the disk. */
+  };
+
+static struct inode_table inode_table;
+static struct inode_stats inode_stats;
+
+static unsigned inode_hash (const struct hash_elem *e, void *aux UNUSED);
+static bool inode_less (const struct hash_elem *a, const struct hash_elem *b,
+                        void *aux UNUSED);
 
 /* Initializes the inode module. */
 void
 inode_init (void) 
 {
-  list_init (&open_inodes);
+  lock_init (&inode_table.lock);
+  hash_init (&inode_table.inodes, inode_hash, inode_less, NULL);
+  list_init (&inode_table.retained);
+  inode_table.retained_cnt = 0;
+  cond_init (&inode_table.ready);
 }
 
 /* Initializes an inode with LENGTH bytes of data and
@@ -72,36 +473,32 @@ inode_init (void)
 bool
 inode_create (block_sector_t sector, off_t length)
 {
-  struct inode_disk *disk_inode = NULL;
-  bool success = false;
+  struct inode *inode;
+  bool success;
 
   ASSERT (length >= 0);
 
-  /* If this assertion fails, the inode structure is not exactly
-     one sector in size, and you should fix that. */
-  ASSERT (sizeof *disk_inode == BLOCK_SECTOR_SIZE);
+  /* If these assertions fail, the on-disk structures are not
+     exactly one sector in size, and you should fix that. */
+  ASSERT (sizeof (struct inode_disk) == BLOCK_SECTOR_SIZE);
+  ASSERT (sizeof (struct indirect_block) == BLOCK_SECTOR_SIZE);
 
-  disk_inode = calloc (1, sizeof *disk_inode);
-  if (disk_inode != NULL)
-    {
-      size_t sectors = bytes_to_sectors (length);
-      disk_inode->length = length;
-      disk_inode->magic = INODE_MAGIC;
-      if (free_map_allocate (sectors, &disk_inode->start)) 
-        {
-          block_write (fs_device, sector, disk_inode);
-          if (sectors > 0) 
-            {
-              static char zeros[BLOCK_SECTOR_SIZE];
-              size_t i;
-              
-              for (i = 0; i < sectors; i++) 
-                block_write (fs_device, disk_inode->start + i, zeros);
-            }
-          success = true; 
-        } 
-      free (disk_inode);
-    }
+  /* Build the inode privately, outside the inode table. */
+  inode = calloc (1, sizeof *inode);
+  if (inode == NULL)
+    return false;
+  inode->sector = sector;
+  inode->data.magic = INODE_MAGIC;
+
+  success = inode_grow (inode, bytes_to_sectors (length), false);
+  if (success)
+    inode->data.length = length;
+  else
+    inode_shrink (inode, 0);
+  cache_write (sector, &inode->data, 0, BLOCK_SECTOR_SIZE);
+
+  free (inode->extents);
+  free (inode);
   return success;
 }
 
@@ -111,33 +508,84 @@ inode_create (block_sector_t sector, off_t length)
 struct inode *
 inode_open (block_sector_t sector)
 {
-  struct list_elem *e;
+  struct inode key;
+  struct hash_elem *e;
   struct inode *inode;
-
-  /* Check whether this inode is already open. */
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-       e = list_next (e)) 
+  bool waited_for_load = false;
+  bool loaded;
+
+  /* Check whether this inode is already in memory.  If it is
+     being read in or closed, wait and look again, as it may have
+     failed to load or been evicted by then.  If it failed to
+     load, fail as well. */
+  lock_acquire (&inode_table.lock);
+  key.sector = sector;
+  while ((e = hash_find (&inode_table.inodes, &key.elem)) != NULL)
+    {
+      inode = hash_entry (e, struct inode, elem);
+      if (!inode->loading && !inode->closing)
+        break;
+      waited_for_load = inode->loading;
+      cond_wait (&inode_table.ready, &inode_table.lock);
+    }
+  if (e == NULL && waited_for_load)
     {
-      inode = list_entry (e, struct inode, elem);
-      if (inode->sector == sector) 
+      lock_release (&inode_table.lock);
+      return NULL;
+    }
+  if (e != NULL)
+    {
+      inode = hash_entry (e, struct inode, elem);
+      if (inode->open_cnt++ == 0)
         {
-          inode_reopen (inode);
-          return inode; 
+          list_remove (&inode->lru_elem);
+          inode_table.retained_cnt--;
+          inode_stats.retained_hits++;
         }
+      else
+        inode_stats.open_hits++;
+      lock_release (&inode_table.lock);
+      return inode; 
     }
 
   /* Allocate memory. */
   inode = malloc (sizeof *inode);
   if (inode == NULL)
-    return NULL;
+    {
+      lock_release (&inode_table.lock);
+      return NULL;
+    }
 
   /* Initialize. */
-  list_push_front (&open_inodes, &inode->elem);
+  inode_stats.misses++;
   inode->sector = sector;
+  hash_insert (&inode_table.inodes, &inode->elem);
   inode->open_cnt = 1;
+  inode->loading = true;
+  inode->closing = false;
   inode->deny_write_cnt = 0;
   inode->removed = false;
-  block_read (fs_device, inode->sector, &inode->data);
+  rwlock_init (&inode->rwlock);
+  lock_init (&inode->lock);
+
+  /* Read the inode without holding the table lock.  Other
+     openers wait until it is read in. */
+  lock_release (&inode_table.lock);
+  cache_read (inode->sector, &inode->data, 0, BLOCK_SECTOR_SIZE);
+  loaded = extent_map_load (inode);
+
+  lock_acquire (&inode_table.lock);
+  inode->loading = false;
+  if (!loaded)
+    hash_delete (&inode_table.inodes, &inode->elem);
+  cond_broadcast (&inode_table.ready, &inode_table.lock);
+  lock_release (&inode_table.lock);
+
+  if (!loaded)
+    {
+      free (inode);
+      return NULL;
+    }
   return inode;
 }
 
@@ -146,7 +594,11 @@ struct inode *
 inode_reopen (struct inode *inode)
 {
   if (inode != NULL)
-    inode->open_cnt++;
+    {
+      lock_acquire (&inode_table.lock);
+      inode->open_cnt++;
+      lock_release (&inode_table.lock);
+    }
   return inode;
 }
 
@@ -157,31 +609,70 @@ inode_get_inumber (const struct inode *inode)
   return inode->sector;
 }
 
-/* Closes INODE and writes it to disk.
-   If this was the last reference to INODE, frees its memory.
-   If INODE was also a removed inode, frees its blocks. */
+/* Closes INODE.
+   If this was the last reference to INODE, the sectors
+   preallocated past its end are released and it is retained in
+   memory, and the least recently closed inode is freed if too
+   many are retained.  If INODE was a removed inode, its blocks
+   and memory are freed instead. */
 void
 inode_close (struct inode *inode) 
 {
+  struct inode *victim = NULL;
+
   /* Ignore null pointer. */
   if (inode == NULL)
     return;
 
-  /* Release resources if this was the last opener. */
-  if (--inode->open_cnt == 0)
+  lock_acquire (&inode_table.lock);
+  if (--inode->open_cnt > 0)
     {
-      /* Remove from inode list and release lock. */
-      list_remove (&inode->elem);
- 
-      /* Deallocate blocks if removed. */
-      if (inode->removed) 
-        {
-          free_map_release (inode->sector, 1);
-          free_map_release (inode->data.start,
-                            bytes_to_sectors (inode->data.length)); 
-        }
+      lock_release (&inode_table.lock);
+      return;
+    }
 
-      free (inode); 
+  /* Nobody else can mark the inode removed now. */
+  if (inode->removed)
+    {
+      hash_delete (&inode_table.inodes, &inode->elem);
+      lock_release (&inode_table.lock);
+
+      inode_shrink (inode, 0);
+      free_map_release (inode->sector, 1);
+      free (inode->extents);
+      free (inode);
+      return;
+    }
+
+  /* Release the sectors preallocated past the end without
+     holding the table lock.  Meanwhile, INODE is marked closing
+     and kept off the retained list, so that it is neither
+     reopened nor evicted. */
+  if (inode->data.sector_cnt > bytes_to_sectors (inode->data.length))
+    {
+      inode->closing = true;
+      lock_release (&inode_table.lock);
+      inode_shrink (inode, bytes_to_sectors (inode->data.length));
+      lock_acquire (&inode_table.lock);
+      inode->closing = false;
+      cond_broadcast (&inode_table.ready, &inode_table.lock);
+    }
+  list_push_back (&inode_table.retained, &inode->lru_elem);
+  if (++inode_table.retained_cnt > INODE_RETAIN_CNT)
+    {
+      victim = list_entry (list_pop_front (&inode_table.retained),
+                           struct inode, lru_elem);
+      hash_delete (&inode_table.inodes, &victim->elem);
+      inode_table.retained_cnt--;
+    }
+  lock_release (&inode_table.lock);
+
+  /* The on-disk inode is always up to date, so it need not be
+     written back. */
+  if (victim != NULL)
+    {
+      free (victim->extents);
+      free (victim);
     }
 }
 
@@ -191,7 +682,25 @@ void
 inode_remove (struct inode *inode) 
 {
   ASSERT (inode != NULL);
+  rwlock_acquire_write (&inode->rwlock);
   inode->removed = true;
+  rwlock_release_write (&inode->rwlock);
+}
+
+/* Acquires INODE's lock, which serializes operations that read
+   and then update INODE's contents, such as changes to the
+   entries of a directory. */
+void
+inode_lock (struct inode *inode)
+{
+  lock_acquire (&inode->lock);
+}
+
+/* Releases INODE's lock. */
+void
+inode_unlock (struct inode *inode)
+{
+  lock_release (&inode->lock);
 }
 
 /* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
@@ -202,128 +711,147 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
 {
   uint8_t *buffer = buffer_;
   off_t bytes_read = 0;
-  uint8_t *bounce = NULL;
 
   while (size > 0) 
     {
       /* Disk sector to read, starting byte offset within sector. */
-      block_sector_t sector_idx = byte_to_sector (inode, offset);
+      block_sector_t sector_idx;
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
       /* Bytes left in inode, bytes left in sector, lesser of the two. */
-      off_t inode_left = inode_length (inode) - offset;
+      off_t inode_left;
       int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
-      int min_left = inode_left < sector_left ? inode_left : sector_left;
+      int min_left;
+
+      rwlock_acquire_read (&inode->rwlock);
+      sector_idx = byte_to_sector (inode, offset);
+      inode_left = inode->data.length - offset;
+      rwlock_release_read (&inode->rwlock);
+      min_left = inode_left < sector_left ? inode_left : sector_left;
 
       /* Number of bytes to actually copy out of this sector. */
       int chunk_size = size < min_left ? size : min_left;
       if (chunk_size <= 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
-        {
-          /* Read full sector directly into caller's buffer. */
-          block_read (fs_device, sector_idx, buffer + bytes_read);
-        }
-      else 
-        {
-          /* Read sector into bounce buffer, then partially copy
-             into caller's buffer. */
-          if (bounce == NULL) 
-            {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
-            }
-          block_read (fs_device, sector_idx, bounce);
-          memcpy (buffer + bytes_read, bounce + sector_ofs, chunk_size);
-        }
+      /* Copy the chunk out of the cached sector. */
+      cache_read (sector_idx, buffer + bytes_read, sector_ofs, chunk_size);
       
       /* Advance. */
       size -= chunk_size;
       offset += chunk_size;
       bytes_read += chunk_size;
     }
-  free (bounce);
 
   return bytes_read;
 }
 
 /* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
+   Extends INODE if the write goes past its end.
    Returns the number of bytes actually written, which may be
-   less than SIZE if end of file is reached or an error occurs.
-   (Normally a write at end of file would extend the inode, but
-   growth is not yet implemented.) */
+   less than SIZE if the disk is full or an error occurs. */
 off_t
 inode_write_at (struct inode *inode, const void *buffer_, off_t size,
                 off_t offset) 
 {
   const uint8_t *buffer = buffer_;
   off_t bytes_written = 0;
-  uint8_t *bounce = NULL;
+  bool grow;
 
+  rwlock_acquire_read (&inode->rwlock);
   if (inode->deny_write_cnt)
-    return 0;
+    {
+      rwlock_release_read (&inode->rwlock);
+      return 0;
+    }
+  grow = offset + size > (off_t) inode->data.sector_cnt * BLOCK_SECTOR_SIZE;
+  rwlock_release_read (&inode->rwlock);
+
+  /* Allocate the sectors to write first.  The new length is set
+     only once the data is written, so readers see zeros or old
+     data, never garbage. */
+  if (grow && size > 0)
+    {
+      rwlock_acquire_write (&inode->rwlock);
+      inode_grow (inode, bytes_to_sectors (offset + size), true);
+      rwlock_release_write (&inode->rwlock);
+    }
 
   while (size > 0) 
     {
       /* Sector to write, starting byte offset within sector. */
-      block_sector_t sector_idx = byte_to_sector (inode, offset);
+      block_sector_t sector_idx;
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
-      /* Bytes left in inode, bytes left in sector, lesser of the two. */
-      off_t inode_left = inode_length (inode) - offset;
+      /* Bytes left in allocated sectors, bytes left in sector,
+         lesser of the two. */
+      off_t inode_left;
       int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
-      int min_left = inode_left < sector_left ? inode_left : sector_left;
+      int min_left;
+
+      rwlock_acquire_read (&inode->rwlock);
+      sector_idx = byte_to_sector (inode, offset);
+      inode_left = ((off_t) inode->data.sector_cnt * BLOCK_SECTOR_SIZE
+                    - offset);
+      rwlock_release_read (&inode->rwlock);
+      min_left = inode_left < sector_left ? inode_left : sector_left;
 
       /* Number of bytes to actually write into this sector. */
       int chunk_size = size < min_left ? size : min_left;
       if (chunk_size <= 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
-        {
-          /* Write full sector directly to disk. */
-          block_write (fs_device, sector_idx, buffer + bytes_written);
-        }
-      else 
-        {
-          /* We need a bounce buffer. */
-          if (bounce == NULL) 
-            {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
-            }
-
-          /* If the sector contains data before or after the chunk
-             we're writing, then we need to read in the sector
-             first.  Otherwise we start with a sector of all zeros. */
-          if (sector_ofs > 0 || chunk_size < sector_left) 
-            block_read (fs_device, sector_idx, bounce);
-          else
-            memset (bounce, 0, BLOCK_SECTOR_SIZE);
-          memcpy (bounce + sector_ofs, buffer + bytes_written, chunk_size);
-          block_write (fs_device, sector_idx, bounce);
-        }
+      /* Copy the chunk into the cached sector.  The cache reads
+         in the rest of the sector if the chunk is partial. */
+      cache_write (sector_idx, buffer + bytes_written, sector_ofs,
+                   chunk_size);
 
       /* Advance. */
       size -= chunk_size;
       offset += chunk_size;
       bytes_written += chunk_size;
     }
-  free (bounce);
+
+  /* Extend the file over the data written. */
+  if (bytes_written > 0)
+    {
+      rwlock_acquire_write (&inode->rwlock);
+      if (offset > inode->data.length)
+        {
+          inode->data.length = offset;
+          cache_write (inode->sector, &inode->data, 0, BLOCK_SECTOR_SIZE);
+        }
+      rwlock_release_write (&inode->rwlock);
+    }
 
   return bytes_written;
 }
 
+/* Queues the sectors holding the SIZE bytes of INODE at OFFSET
+   to be read into the buffer cache in the background. */
+void
+inode_readahead (struct inode *inode, off_t size, off_t offset)
+{
+  off_t end = offset + size;
+
+  rwlock_acquire_read (&inode->rwlock);
+  if (end > inode->data.length)
+    end = inode->data.length;
+  offset -= offset % BLOCK_SECTOR_SIZE;
+  for (; offset < end; offset += BLOCK_SECTOR_SIZE)
+    cache_readahead (byte_to_sector (inode, offset));
+  rwlock_release_read (&inode->rwlock);
+}
+
 /* Disables writes to INODE.
    May be called at most once per inode opener. */
 void
 inode_deny_write (struct inode *inode) 
 {
+  rwlock_acquire_write (&inode->rwlock);
   inode->deny_write_cnt++;
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
+  rwlock_release_write (&inode->rwlock);
 }
 
 /* Re-enables writes to INODE.
@@ -332,14 +860,47 @@ inode_deny_write (struct inode *inode)
 void
 inode_allow_write (struct inode *inode) 
 {
+  rwlock_acquire_write (&inode->rwlock);
   ASSERT (inode->deny_write_cnt > 0);
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
   inode->deny_write_cnt--;
+  rwlock_release_write (&inode->rwlock);
+}
+
+/* Prints inode table statistics. */
+void
+inode_print_stats (void)
+{
+  printf ("Inodes: %lld opens of open inodes, %lld of retained inodes, "
+          "%lld read from disk\n",
+          inode_stats.open_hits, inode_stats.retained_hits,
+          inode_stats.misses);
+}
+
+/* Returns a hash of the sector of inode E. */
+static unsigned
+inode_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  return hash_int (hash_entry (e, struct inode, elem)->sector);
+}
+
+/* Returns true if inode A's sector is lower than inode B's. */
+static bool
+inode_less (const struct hash_elem *a, const struct hash_elem *b,
+            void *aux UNUSED)
+{
+  return (hash_entry (a, struct inode, elem)->sector
+          < hash_entry (b, struct inode, elem)->sector);
 }
 
 /* Returns the length, in bytes, of INODE's data. */
 off_t
-inode_length (const struct inode *inode)
+inode_length (struct inode *inode)
 {
-  return inode->data.length;
+  off_t length;
+
+  rwlock_acquire_read (&inode->rwlock);
+  length = inode->data.length;
+  rwlock_release_read (&inode->rwlock);
+  return length;
 }
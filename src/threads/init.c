@@ -24,7 +24,6 @@
 #include "threads/thread.h"
 
 #ifdef USERPROG
-#include "filesys/filesys_lock.h"
 #include "userprog/process.h"
 #include "userprog/exception.h"
 #include "userprog/gdt.h"
@@ -35,13 +34,17 @@
 #endif
 
 #ifdef VM
+#include <vm/compressed_swap.h>
 #include <vm/frame.h>
+#include <vm/shared_page.h>
+#include <vm/supp_page.h>
 #include <vm/swap.h>
 #endif
 
 #ifdef FILESYS
 #include "devices/block.h"
 #include "devices/ide.h"
+#include "filesys/cache.h"
 #include "filesys/filesys.h"
 #include "filesys/fsutil.h"
 #endif
@@ -57,6 +60,12 @@ static bool format_filesys;
    overriding the defaults. */
 static const char *filesys_bdev_name;
 static const char *scratch_bdev_name;
+
+/* -cache: Number of file system sectors in the buffer cache. */
+static size_t cache_sectors = CACHE_SECTORS;
+
+/* -flush: Timer ticks between writes of dirty cached sectors. */
+static int64_t cache_flush_ticks = CACHE_FLUSH_TICKS;
 #ifdef VM
 static const char *swap_bdev_name;
 #endif
@@ -65,6 +74,21 @@ static const char *swap_bdev_name;
 /* -ul: Maximum number of pages to put into palloc's user pool. */
 static size_t user_page_limit = SIZE_MAX;
 
+#ifdef VM
+/* -ulow, -uhigh: Free user page watermarks for the pageout daemon. */
+static size_t pageout_low_watermark = PAGEOUT_LOW_WATERMARK;
+static size_t pageout_high_watermark = PAGEOUT_HIGH_WATERMARK;
+
+/* -fa: Pages read in around a fault on a file page. */
+static size_t fault_around_pages = FAULT_AROUND_PAGES;
+
+/* -rss: Most user pages a process may keep resident, or 0 for no limit. */
+static size_t resident_limit = 0;
+
+/* -zpool: Kernel pages holding compressed swapped out pages. */
+static size_t compressed_swap_pages = COMPRESSED_SWAP_PAGES;
+#endif
+
 static void bss_init (void);
 static void paging_init (void);
 
@@ -120,7 +144,6 @@ main (void)
   input_init ();
 #ifdef USERPROG
   exception_init ();
-  filesys_lock_init ();
   process_create_process_info (thread_current ());
   syscall_init ();
 #endif
@@ -134,12 +157,17 @@ main (void)
   /* Initialize file system. */
   ide_init ();
   locate_block_devices ();
+  cache_init (cache_sectors, cache_flush_ticks);
   filesys_init (format_filesys);
 #endif
 
 #ifdef VM
-  frame_init ();
+  frame_init (pageout_low_watermark, pageout_high_watermark,
+              resident_limit);
+  shared_page_init ();
+  supp_page_init (fault_around_pages);
   swap_init ();
+  compressed_swap_init (compressed_swap_pages);
 #endif
 
   printf ("Boot complete.\n");
@@ -262,6 +290,10 @@ parse_options (char **argv)
         filesys_bdev_name = value;
       else if (!strcmp (name, "-scratch"))
         scratch_bdev_name = value;
+      else if (!strcmp (name, "-cache"))
+        cache_sectors = atoi (value);
+      else if (!strcmp (name, "-flush"))
+        cache_flush_ticks = atoi (value);
 #ifdef VM
       else if (!strcmp (name, "-swap"))
         swap_bdev_name = value;
@@ -274,6 +306,18 @@ parse_options (char **argv)
 #ifdef USERPROG
       else if (!strcmp (name, "-ul"))
         user_page_limit = atoi (value);
+#endif
+#ifdef VM
+      else if (!strcmp (name, "-ulow"))
+        pageout_low_watermark = atoi (value);
+      else if (!strcmp (name, "-uhigh"))
+        pageout_high_watermark = atoi (value);
+      else if (!strcmp (name, "-rss"))
+        resident_limit = atoi (value);
+      else if (!strcmp (name, "-fa"))
+        fault_around_pages = atoi (value);
+      else if (!strcmp (name, "-zpool"))
+        compressed_swap_pages = atoi (value);
 #endif
       else
         PANIC ("unknown option `%s' (use -h for help)", name);
@@ -389,6 +433,8 @@ usage (void)
           "  -f                 Format file system device during startup.\n"
           "  -filesys=BDEV      Use BDEV for file system instead of default.\n"
           "  -scratch=BDEV      Use BDEV for scratch instead of default.\n"
+          "  -cache=COUNT       Cache COUNT file system sectors.\n"
+          "  -flush=TICKS       Write back cached sectors every TICKS ticks.\n"
 #ifdef VM
           "  -swap=BDEV         Use BDEV for swap instead of default.\n"
 #endif
@@ -397,6 +443,13 @@ usage (void)
           "  -mlfqs             Use multi-level feedback queue scheduler.\n"
 #ifdef USERPROG
           "  -ul=COUNT          Limit user memory to COUNT pages.\n"
+#endif
+#ifdef VM
+          "  -ulow=COUNT        Start paging out below COUNT free user pages.\n"
+          "  -uhigh=COUNT       Stop paging out at COUNT free user pages.\n"
+          "  -rss=COUNT         Keep at most COUNT pages of a process resident.\n"
+          "  -fa=COUNT          Read in COUNT file pages around a page fault.\n"
+          "  -zpool=COUNT       Keep swapped pages compressed in COUNT pages.\n"
 #endif
           );
   shutdown_power_off ();
@@ -486,6 +486,85 @@ cond_broadcast (struct condition *cond, struct lock *lock)
     cond_signal (cond, lock);
 }
 
+/* Initializes RWLOCK.  Any number of readers may hold a
+   readers-writer lock at once, or else a single writer.  Waiting
+   writers go before new readers, so that readers cannot starve
+   them.  Like a lock, it is not recursive. */
+void
+rwlock_init (struct rwlock *rwlock)
+{
+  ASSERT (rwlock != NULL);
+
+  lock_init (&rwlock->lock);
+  cond_init (&rwlock->readers_ok);
+  cond_init (&rwlock->writer_ok);
+  rwlock->reader_cnt = 0;
+  rwlock->writers_waiting = 0;
+  rwlock->writer = NULL;
+}
+
+/* Acquires RWLOCK for reading, sleeping until no writer holds
+   it or waits for it. */
+void
+rwlock_acquire_read (struct rwlock *rwlock)
+{
+  ASSERT (rwlock->writer != thread_current ());
+
+  lock_acquire (&rwlock->lock);
+  while (rwlock->writer != NULL || rwlock->writers_waiting > 0)
+    cond_wait (&rwlock->readers_ok, &rwlock->lock);
+  rwlock->reader_cnt++;
+  lock_release (&rwlock->lock);
+}
+
+/* Releases RWLOCK, which the current thread holds for reading. */
+void
+rwlock_release_read (struct rwlock *rwlock)
+{
+  lock_acquire (&rwlock->lock);
+  ASSERT (rwlock->reader_cnt > 0);
+  if (--rwlock->reader_cnt == 0)
+    cond_signal (&rwlock->writer_ok, &rwlock->lock);
+  lock_release (&rwlock->lock);
+}
+
+/* Acquires RWLOCK for writing, sleeping until no other thread
+   holds it. */
+void
+rwlock_acquire_write (struct rwlock *rwlock)
+{
+  ASSERT (rwlock->writer != thread_current ());
+
+  lock_acquire (&rwlock->lock);
+  rwlock->writers_waiting++;
+  while (rwlock->writer != NULL || rwlock->reader_cnt > 0)
+    cond_wait (&rwlock->writer_ok, &rwlock->lock);
+  rwlock->writers_waiting--;
+  rwlock->writer = thread_current ();
+  lock_release (&rwlock->lock);
+}
+
+/* Releases RWLOCK, which the current thread holds for writing. */
+void
+rwlock_release_write (struct rwlock *rwlock)
+{
+  lock_acquire (&rwlock->lock);
+  ASSERT (rwlock->writer == thread_current ());
+  rwlock->writer = NULL;
+  if (rwlock->writers_waiting > 0)
+    cond_signal (&rwlock->writer_ok, &rwlock->lock);
+  else
+    cond_broadcast (&rwlock->readers_ok, &rwlock->lock);
+  lock_release (&rwlock->lock);
+}
+
+/* Returns true if the current thread holds RWLOCK for writing. */
+bool
+rwlock_held_for_write (const struct rwlock *rwlock)
+{
+  return rwlock->writer == thread_current ();
+}
+
 /* If given aux, uses value from aux for pa. */
 bool
 cond_sema_insert_priority (const struct list_elem *a UNUSED,
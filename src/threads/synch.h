@@ -46,6 +46,24 @@ void cond_update (struct condition *);
 void cond_signal (struct condition *, struct lock *);
 void cond_broadcast (struct condition *, struct lock *);
 
+/* Readers-writer lock. */
+struct rwlock
+  {
+    struct lock lock;           /* Protects the members below. */
+    struct condition readers_ok; /* Signalled when readers may enter. */
+    struct condition writer_ok; /* Signalled when a writer may enter. */
+    unsigned reader_cnt;        /* Number of readers holding it. */
+    unsigned writers_waiting;   /* Number of writers waiting. */
+    struct thread *writer;      /* Writer holding it, if any. */
+  };
+
+void rwlock_init (struct rwlock *);
+void rwlock_acquire_read (struct rwlock *);
+void rwlock_release_read (struct rwlock *);
+void rwlock_acquire_write (struct rwlock *);
+void rwlock_release_write (struct rwlock *);
+bool rwlock_held_for_write (const struct rwlock *);
+
 /* Optimization barrier.
 
    The compiler will not reorder operations across an
@@ -6,6 +6,7 @@
 #include <random.h>
 #include <stdio.h>
 #include <string.h>
+#include "devices/block.h"
 #include "threads/flags.h"
 #include "threads/interrupt.h"
 #include "threads/intr-stubs.h"
@@ -691,6 +692,7 @@ init_thread (struct thread *t, const char *name, int priority,
      uninitialized variables. */
   t->nice = 0;
   t->recent_cpu = to_fixed_point (0);
+  t->io_class = BLOCK_IO_FOREGROUND;
 
   list_init (&t->locks);
   t->blocker = NULL; /* Threads are born with limitless possibilities. */
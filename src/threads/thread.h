@@ -129,6 +129,9 @@ struct thread
 
     struct list_elem mlfqs_elem;        /* Used by the MLFQS */
 
+    int io_class;                       /* enum block_io_class of the
+                                           block requests it submits. */
+
 #ifdef USERPROG
     /* The pid of the process owning this thread. */
     process_info p_info;
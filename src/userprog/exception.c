@@ -182,10 +182,16 @@ page_fault (struct intr_frame *f)
             {
               thread_exit ();
             }
-          grow_stack (fault_addr, f->esp);
+          grow_stack (fault_addr, f->esp, write);
           return;
         }
-      supp_page_map_addr (segment, fault_addr);
+      supp_page_map_addr (segment, fault_addr, write);
+      return;
+    }
+  /* A write to a page still mapped to the zero page gives it its own frame. */
+  if (write && supp_page_is_zero_mapped (segment, fault_addr))
+    {
+      supp_page_map_addr (segment, fault_addr, write);
       return;
     }
 #endif
@@ -17,7 +17,6 @@
 #include "filesys/directory.h"
 #include "filesys/file.h"
 #include "filesys/filesys.h"
-#include "filesys/filesys_lock.h"
 #include "threads/flags.h"
 #include "threads/init.h"
 #include "threads/interrupt.h"
@@ -428,13 +427,10 @@ load (char *fn_args, void (**eip) (void), void **esp)
     goto done;
   process_activate ();
 
-  /* Lock filesystem to deny write to file that is being read. */
-  filesys_lock_acquire ();
   /* Open executable file. */
   file = filesys_open (file_name);
   if (file == NULL)
     {
-      filesys_lock_release ();
       printf ("load: %s: open failed\n", file_name);
       goto done;
     }
@@ -444,7 +440,6 @@ load (char *fn_args, void (**eip) (void), void **esp)
 
   /* Read and verify executable header. */
   off_t bytes_read = file_read (file, &ehdr, sizeof ehdr);
-  filesys_lock_release ();
 
   if (bytes_read != sizeof ehdr
       || memcmp (ehdr.e_ident, "\177ELF\1\1\1", 7)
@@ -464,20 +459,12 @@ load (char *fn_args, void (**eip) (void), void **esp)
     {
       struct Elf32_Phdr phdr;
 
-      filesys_lock_acquire ();
       if (file_ofs < 0 || file_ofs > file_length (file))
-        {
-          filesys_lock_release ();
-          goto done;
-        }
+        goto done;
       file_seek (file, file_ofs);
 
       if (file_read (file, &phdr, sizeof phdr) != sizeof phdr)
-        {
-          filesys_lock_release ();
-          goto done;
-        }
-      filesys_lock_release ();
+        goto done;
 
       file_ofs += sizeof phdr;
       switch (phdr.p_type)
@@ -688,7 +675,6 @@ load_segment (struct file *file, off_t ofs, uint8_t *upage,
   ASSERT (ofs % PGSIZE == 0);
 
 #ifndef VM
-  file_seek (file, ofs);
   while (read_bytes > 0 || zero_bytes > 0)
     {
       /* Calculate how to fill this page.
@@ -703,13 +689,8 @@ load_segment (struct file *file, off_t ofs, uint8_t *upage,
         return false;
 
       /* Load this page. */
-      filesys_lock_acquire ();
-      if (!read_page (kpage, file, page_read_bytes, page_zero_bytes))
-        {
-          filesys_lock_release ();
-          return false;
-        }
-      filesys_lock_release ();
+      if (!read_page (kpage, file, ofs, page_read_bytes, page_zero_bytes))
+        return false;
 
       /* Add the page to the process's address space. */
       if (!install_page (upage, kpage, writable))
@@ -721,6 +702,7 @@ load_segment (struct file *file, off_t ofs, uint8_t *upage,
       /* Advance. */
       read_bytes -= page_read_bytes;
       zero_bytes -= page_zero_bytes;
+      ofs += page_read_bytes;
       upage += PGSIZE;
     }
 #else
@@ -766,7 +748,8 @@ setup_stack (void **esp)
   stack_growth_init ();
   /* Create the first page right now instead of waiting for it to fault,
      as some kernel code needs it set up anyway. */
-  supp_page_map_addr_directly (&thread_current ()->supp_page_table, upage);
+  supp_page_map_addr_directly (&thread_current ()->supp_page_table, upage,
+                               true);
   thread_current ()->stack_bottom = upage;
 
   return true;
@@ -10,19 +10,20 @@
 
 #include <userprog/read_page.h>
 
-/* Try to read a page from a file.
+/* Try to read a page from a file, starting at offset ofs in the file.
    page_read_bytes gives the number of bytes to read from the file, and
    page_zero_bytes gives the number of bytes to zero out after the bytes
    read from the file.
    Hence, page_read_bytes and page_zero_bytes must sum to PGSIZE.
    Returns true if the read succeeded, false otherwise. */
 bool
-read_page (void *kpage, struct file *file,
+read_page (void *kpage, struct file *file, off_t ofs,
            size_t page_read_bytes, size_t page_zero_bytes)
 {
   ASSERT (page_read_bytes + page_zero_bytes == PGSIZE);
 
-  if (file_read (file, kpage, page_read_bytes) != (int) page_read_bytes)
+  if (file_read_at (file, kpage, page_read_bytes, ofs)
+      != (int) page_read_bytes)
     {
 #ifndef VM
       palloc_free_page (kpage);
@@ -4,7 +4,7 @@
 #include <stddef.h>
 #include <filesys/file.h>
 
-bool read_page (void *kpage, struct file *file,
+bool read_page (void *kpage, struct file *file, off_t ofs,
                 size_t page_read_bytes, size_t read_zero_bytes);
 
 #endif /* userprog/read_page.h */
@@ -9,7 +9,6 @@
 #include "devices/shutdown.h"
 
 /* Syscall required imports. */
-#include "filesys/filesys_lock.h"
 /* halt */
 #include "devices/shutdown.h"
 /* write */
@@ -254,11 +253,7 @@ static bool
 syscall_create (const char *file, unsigned initial_size)
 {
   check_filename (file);
-  bool success = false;
-  filesys_lock_acquire ();
-  success = filesys_create (file, initial_size);
-  filesys_lock_release ();
-  return success;
+  return filesys_create (file, initial_size);
 }
 
 /* Removes a file from the file system.
@@ -267,11 +262,7 @@ static bool
 syscall_remove (const char *file)
 {
   check_filename (file);
-  bool success = false;
-  filesys_lock_acquire ();
-  success = filesys_remove (file);
-  filesys_lock_release ();
-  return success;
+  return filesys_remove (file);
 }
 
 /* Opens file with given name.
@@ -280,9 +271,7 @@ static int
 syscall_open (const char *file)
 {
   check_filename (file);
-  filesys_lock_acquire ();
   struct file *open_file = filesys_open (file);
-  filesys_lock_release ();
   if (open_file == NULL) /* File not found. */
     {
       return ABNORMAL_IO_VALUE;
@@ -296,14 +285,11 @@ static int
 syscall_filesize (int fd)
 {
   int size = ABNORMAL_IO_VALUE; /* File not found default value. */
-  filesys_lock_acquire ();
   struct file *file = process_fetch_file (fd);
   if (file != NULL) /* File found. */
     {
       size = file_length (file);
     }
-
-  filesys_lock_release ();
   return size;
 }
 
@@ -319,14 +305,11 @@ syscall_read (int fd, void *buffer, unsigned size)
       return ret; /* Bad fd. */
     }
 
-  filesys_lock_acquire ();
   struct file *file = process_fetch_file (fd);
   if (file != NULL) /* File not found. */
     {
-      ret = file_read_at (file, buffer, size, file_tell (file));
-      file_seek (file, file_tell (file) + ret);
+      ret = file_read (file, buffer, size);
     }
-  filesys_lock_release ();
   return ret;
 }
 
@@ -334,7 +317,7 @@ syscall_read (int fd, void *buffer, unsigned size)
   Writes size bytes from buffer to open file fd.
   Returns number of bytes written.
 
-  Does not extend files past their size.
+  Extends files which are written past their end.
   If fd = 1, writes to console with putbuf.
 */
 static int
@@ -363,10 +346,7 @@ syscall_write (int fd, const void *buffer, unsigned size)
         {
           return ABNORMAL_IO_VALUE;
         }
-      filesys_lock_acquire ();
-      written = file_write_at (file, buffer, size, file_tell (file));
-      file_seek (file, file_tell (file) + written);
-      filesys_lock_release ();
+      written = file_write (file, buffer, size);
     }
 
   return written;
@@ -377,13 +357,11 @@ syscall_write (int fd, const void *buffer, unsigned size)
 static void
 syscall_seek (int fd, unsigned position)
 {
-  filesys_lock_acquire ();
   struct file *file = process_fetch_file (fd);
   if (file != NULL) /* File found. */
     {
       file_seek (file, position);
     }
-  filesys_lock_release ();
 }
 
 /* Returns the position of the next byte to be read or written in open file fd,
@@ -393,13 +371,11 @@ static unsigned
 syscall_tell (int fd)
 {
   unsigned pos = ABNORMAL_IO_VALUE; /* Default file-not-found position. */
-  filesys_lock_acquire ();
   struct file *file = process_fetch_file (fd);
   if (file != NULL) /* File found. */
     {
       pos = file_tell (file);
     }
-  filesys_lock_release ();
   return pos;
 }
 
@@ -407,11 +383,9 @@ syscall_tell (int fd)
 static void
 syscall_close (int fd)
 {
-  filesys_lock_acquire ();
   struct file *file = process_remove_file (fd);
   if (file != NULL) /* File found. */
     {
       file_close (file);
     }
-  filesys_lock_release ();
 }
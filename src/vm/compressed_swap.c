@@ -0,0 +1,484 @@
+#include <vm/compressed_swap.h>
+
+#include <bitmap.h>
+#include <debug.h>
+#include <hash.h>
+#include <list.h>
+#include <round.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <threads/malloc.h>
+#include <threads/palloc.h>
+#include <threads/synch.h>
+#include <threads/vaddr.h>
+
+/* The compressed swap tier keeps swapped out pages compressed in a pool of
+   kernel memory, in front of the swap device. A page written to swap is
+   compressed into the pool under its swap slot, and only reaches the device
+   once the pool is full and it is the least recently stored page in it, or
+   if it does not compress well enough to be worth keeping. Reading a slot back
+   checks the pool before the device.
+
+   The pool is divided into chunks of CHUNK_SIZE bytes, and each page takes a
+   run of consecutive chunks. Pages are compressed with a small LZ77 codec in
+   the style of LZ4, which finds matches through a hash table of the positions
+   of recently seen 4-byte sequences. */
+
+/* Size of the units the pool is allocated in. */
+#define CHUNK_SIZE 64
+/* Pages which do not compress below this size go straight to the device. */
+#define MAX_STORED_SIZE (PGSIZE * 3 / 4)
+
+/* Shortest match the codec encodes, and the size of its hash table. */
+#define MIN_MATCH 4
+#define HASH_BITS 12
+
+/* A compressed page held in the pool. */
+struct compressed_page
+  {
+    struct hash_elem elem;  /* For placing this in the table of pages. */
+    struct list_elem lru_elem; /* For placing this in the LRU list. */
+    slot_no slot;           /* Swap slot the page was written to. */
+    size_t first_chunk;     /* First chunk of the pool holding the page. */
+    size_t size;            /* Compressed size of the page in bytes. */
+    /* Whether the page is being written back to the device, in which case
+       it is not in the LRU list, but can still be read from the pool. */
+    bool writing;
+    /* Whether the slot was freed while the page was being written back, so
+       that the writer has to free it once it is done. */
+    bool freed;
+  };
+
+/* Statistics about the compressed tier. */
+struct compressed_swap_stats
+  {
+    long long stores;       /* Pages stored in the pool. */
+    long long rejects;      /* Pages which did not compress well enough. */
+    long long hits;         /* Reads served from the pool. */
+    long long misses;       /* Reads which had to go to the device. */
+    long long writebacks;   /* Pages moved from the pool to the device. */
+    long long stored_bytes; /* Compressed size of all the pages stored. */
+  };
+
+static size_t lz_compress (const uint8_t *src, uint8_t *dst, size_t dst_max);
+static void lz_decompress (const uint8_t *src, uint8_t *dst);
+static struct compressed_page *lookup_page (slot_no slot);
+static void remove_page (struct compressed_page *page);
+static bool write_back_oldest (void);
+static unsigned page_hash_func (const struct hash_elem *e, void *aux UNUSED);
+static bool page_less_func (const struct hash_elem *a,
+                            const struct hash_elem *b,
+                            void *aux UNUSED);
+
+static uint8_t *pool;          /* Memory holding the compressed pages. */
+static struct bitmap *chunks;  /* Used chunks of the pool. */
+static struct hash pages;      /* Pages in the pool, by slot. */
+/* Pages in the pool, least recently stored first. */
+static struct list lru;
+/* Protects everything above, and the buffers below. It is not held while
+   pages are written back to the device. */
+static struct lock tier_lock;
+
+/* Page compressed into before being copied to the pool. */
+static uint8_t *scratch;
+/* Positions of the 4-byte sequences seen by the compressor. */
+static uint16_t match_table[1 << HASH_BITS];
+
+static struct compressed_swap_stats stats;
+
+/* Initializes the compressed tier, taking POOL_PAGES pages from the kernel
+   pool to hold compressed pages. A POOL_PAGES of 0 disables the tier. */
+void
+compressed_swap_init (size_t pool_pages)
+{
+  lock_init (&tier_lock);
+  hash_init (&pages, page_hash_func, page_less_func, NULL);
+  list_init (&lru);
+  if (pool_pages == 0)
+    {
+      return;
+    }
+  pool = palloc_get_multiple (PAL_ASSERT, pool_pages);
+  scratch = palloc_get_page (PAL_ASSERT);
+  chunks = bitmap_create (pool_pages * PGSIZE / CHUNK_SIZE);
+  if (chunks == NULL)
+    {
+      PANIC ("Could not allocate the compressed swap pool.");
+    }
+}
+
+/* Stores the page at KPAGE compressed in the pool, as the contents of swap
+   slot SLOT, writing the oldest pages in the pool out to the device to make
+   room if needed. Other threads can use the tier while that happens.
+   Returns false if the page was not stored, in which case it must be written
+   to the device. */
+bool
+compressed_swap_store (slot_no slot, const void *kpage)
+{
+  if (pool == NULL)
+    {
+      return false;
+    }
+
+  lock_acquire (&tier_lock);
+  ASSERT (lookup_page (slot) == NULL);
+  size_t size = lz_compress (kpage, scratch, MAX_STORED_SIZE);
+  struct compressed_page *page = size != 0 ? malloc (sizeof *page) : NULL;
+  if (page == NULL)
+    {
+      ++stats.rejects;
+      lock_release (&tier_lock);
+      return false;
+    }
+
+  size_t chunk_cnt = DIV_ROUND_UP (size, CHUNK_SIZE);
+  size_t first_chunk = bitmap_scan_and_flip (chunks, 0, chunk_cnt, false);
+  bool wrote_back = false;
+  while (first_chunk == BITMAP_ERROR && write_back_oldest ())
+    {
+      wrote_back = true;
+      first_chunk = bitmap_scan_and_flip (chunks, 0, chunk_cnt, false);
+    }
+  if (first_chunk == BITMAP_ERROR)
+    {
+      free (page);
+      ++stats.rejects;
+      lock_release (&tier_lock);
+      return false;
+    }
+  if (wrote_back)
+    {
+      /* Another store may have used the scratch buffer while the lock was
+         dropped. Compression is deterministic, so this gives SIZE bytes. */
+      lz_compress (kpage, scratch, MAX_STORED_SIZE);
+    }
+
+  memcpy (pool + first_chunk * CHUNK_SIZE, scratch, size);
+  page->slot = slot;
+  page->first_chunk = first_chunk;
+  page->size = size;
+  page->writing = false;
+  page->freed = false;
+  hash_insert (&pages, &page->elem);
+  list_push_back (&lru, &page->lru_elem);
+  ++stats.stores;
+  stats.stored_bytes += size;
+  lock_release (&tier_lock);
+  return true;
+}
+
+/* Reads the contents of swap slot SLOT into KPAGE, if the slot is held in the
+   pool. The page stays in the pool, as the slot keeps a copy of the page
+   while it is clean, but it is the first to be written back if room is
+   needed, as it is now also in memory.
+   Returns false if the slot is not in the pool, so must be read from the
+   device. */
+bool
+compressed_swap_load (slot_no slot, void *kpage)
+{
+  lock_acquire (&tier_lock);
+  struct compressed_page *page = lookup_page (slot);
+  if (page == NULL)
+    {
+      ++stats.misses;
+      lock_release (&tier_lock);
+      return false;
+    }
+  lz_decompress (pool + page->first_chunk * CHUNK_SIZE, kpage);
+  if (!page->writing)
+    {
+      list_remove (&page->lru_elem);
+      list_push_front (&lru, &page->lru_elem);
+    }
+  ++stats.hits;
+  lock_release (&tier_lock);
+  return true;
+}
+
+/* Drops the copy of swap slot SLOT from the pool, if there is one, as the
+   slot is being freed.
+   Returns false if the page is being written back to the slot, in which case
+   the slot must not be reused yet: it is freed once the write is done. */
+bool
+compressed_swap_invalidate (slot_no slot)
+{
+  bool can_free = true;
+  lock_acquire (&tier_lock);
+  struct compressed_page *page = lookup_page (slot);
+  if (page != NULL && page->writing)
+    {
+      page->freed = true;
+      can_free = false;
+    }
+  else if (page != NULL)
+    {
+      remove_page (page);
+    }
+  lock_release (&tier_lock);
+  return can_free;
+}
+
+/* Prints statistics about the compressed tier. */
+void
+compressed_swap_print_stats (void)
+{
+  long long ratio = stats.stores > 0
+    ? stats.stored_bytes * 100 / (stats.stores * PGSIZE) : 0;
+  printf ("Compressed swap: %lld pages stored (%lld%% of their size), "
+          "%lld rejected\n", stats.stores, ratio, stats.rejects);
+  printf ("Compressed swap: %lld hits, %lld misses, %lld written back\n",
+          stats.hits, stats.misses, stats.writebacks);
+}
+
+/* Looks up the page stored for swap slot SLOT. */
+static struct compressed_page *
+lookup_page (slot_no slot)
+{
+  ASSERT (lock_held_by_current_thread (&tier_lock));
+  struct compressed_page for_lookup;
+  for_lookup.slot = slot;
+  struct hash_elem *e = hash_find (&pages, &for_lookup.elem);
+  return e != NULL ? hash_entry (e, struct compressed_page, elem) : NULL;
+}
+
+/* Removes PAGE from the pool and frees its chunks. */
+static void
+remove_page (struct compressed_page *page)
+{
+  ASSERT (lock_held_by_current_thread (&tier_lock));
+  bitmap_set_multiple (chunks, page->first_chunk,
+                       DIV_ROUND_UP (page->size, CHUNK_SIZE), false);
+  hash_delete (&pages, &page->elem);
+  if (!page->writing)
+    {
+      list_remove (&page->lru_elem);
+    }
+  free (page);
+}
+
+/* Writes the least recently stored page in the pool out to its slot on the
+   swap device, and removes it from the pool. The lock is dropped during the
+   write, while the page stays in the pool, so that it can still be read.
+   Returns false if the pool is empty, or if no page could be allocated to
+   decompress into. */
+static bool
+write_back_oldest (void)
+{
+  ASSERT (lock_held_by_current_thread (&tier_lock));
+  if (list_empty (&lru))
+    {
+      return false;
+    }
+  void *bounce = palloc_get_page (0);
+  if (bounce == NULL)
+    {
+      return false;
+    }
+  struct compressed_page *page =
+    list_entry (list_pop_front (&lru), struct compressed_page, lru_elem);
+  page->writing = true;
+  lz_decompress (pool + page->first_chunk * CHUNK_SIZE, bounce);
+
+  lock_release (&tier_lock);
+  swap_write_to_device (page->slot, bounce);
+  palloc_free_page (bounce);
+  lock_acquire (&tier_lock);
+
+  slot_no slot = page->slot;
+  bool freed = page->freed;
+  remove_page (page);
+  ++stats.writebacks;
+  if (freed)
+    {
+      lock_release (&tier_lock);
+      swap_free_slot (slot);
+      lock_acquire (&tier_lock);
+    }
+  return true;
+}
+
+/* Reads 4 bytes from a possibly unaligned address. */
+static inline uint32_t
+read_u32 (const uint8_t *p)
+{
+  uint32_t value;
+  memcpy (&value, p, sizeof value);
+  return value;
+}
+
+/* Appends the length LEN, the part of which did not fit in a token, as a
+   sequence of bytes of 255 ended by a smaller byte. Returns the new output
+   position, or 0 if it did not fit. */
+static size_t
+put_length (uint8_t *dst, size_t op, size_t dst_max, size_t len)
+{
+  for (;;)
+    {
+      if (op >= dst_max)
+        {
+          return 0;
+        }
+      dst[op++] = len >= 255 ? 255 : len;
+      if (len < 255)
+        {
+          return op;
+        }
+      len -= 255;
+    }
+}
+
+/* Appends a sequence: LIT_LEN literals taken from LIT, followed by a match of
+   MATCH_LEN bytes found OFFSET bytes back. A MATCH_LEN of 0 marks the final
+   sequence, which has no match. Returns the new output position, or 0 if it
+   did not fit. */
+static size_t
+put_sequence (uint8_t *dst, size_t op, size_t dst_max, const uint8_t *lit,
+              size_t lit_len, size_t offset, size_t match_len)
+{
+  if (op >= dst_max)
+    {
+      return 0;
+    }
+  size_t match_code = match_len != 0 ? match_len - MIN_MATCH : 0;
+  uint8_t *token = &dst[op++];
+  *token = (lit_len >= 15 ? 15 : lit_len) << 4
+           | (match_code >= 15 ? 15 : match_code);
+  if (lit_len >= 15 && (op = put_length (dst, op, dst_max, lit_len - 15)) == 0)
+    {
+      return 0;
+    }
+  if (op + lit_len > dst_max)
+    {
+      return 0;
+    }
+  memcpy (dst + op, lit, lit_len);
+  op += lit_len;
+  if (match_len == 0)
+    {
+      return op;
+    }
+  if (op + 2 > dst_max)
+    {
+      return 0;
+    }
+  dst[op++] = offset & 0xff;
+  dst[op++] = offset >> 8;
+  if (match_code >= 15)
+    {
+      op = put_length (dst, op, dst_max, match_code - 15);
+    }
+  return op;
+}
+
+/* Compresses the page at SRC into DST.
+   Returns the compressed size, or 0 if it would exceed DST_MAX bytes. */
+static size_t
+lz_compress (const uint8_t *src, uint8_t *dst, size_t dst_max)
+{
+  memset (match_table, 0, sizeof match_table);
+  size_t ip = 0;
+  size_t anchor = 0;
+  size_t op = 0;
+  while (ip + MIN_MATCH <= PGSIZE)
+    {
+      uint32_t seq = read_u32 (src + ip);
+      size_t h = (seq * 2654435761u) >> (32 - HASH_BITS);
+      size_t ref = match_table[h];
+      match_table[h] = ip;
+      if (ref >= ip || read_u32 (src + ref) != seq)
+        {
+          ip++;
+          continue;
+        }
+
+      size_t len = MIN_MATCH;
+      while (ip + len < PGSIZE && src[ref + len] == src[ip + len])
+        {
+          len++;
+        }
+      op = put_sequence (dst, op, dst_max, src + anchor, ip - anchor,
+                         ip - ref, len);
+      if (op == 0)
+        {
+          return 0;
+        }
+      ip += len;
+      anchor = ip;
+    }
+  return put_sequence (dst, op, dst_max, src + anchor, PGSIZE - anchor, 0, 0);
+}
+
+/* Reads a length continued past its token, as written by put_length(). */
+static size_t
+get_length (const uint8_t **src)
+{
+  size_t len = 0;
+  uint8_t byte;
+  do
+    {
+      byte = *(*src)++;
+      len += byte;
+    }
+  while (byte == 255);
+  return len;
+}
+
+/* Decompresses a page compressed by lz_compress() from SRC into the page at
+   DST. */
+static void
+lz_decompress (const uint8_t *src, uint8_t *dst)
+{
+  size_t op = 0;
+  for (;;)
+    {
+      uint8_t token = *src++;
+      size_t lit_len = token >> 4;
+      if (lit_len == 15)
+        {
+          lit_len += get_length (&src);
+        }
+      ASSERT (op + lit_len <= PGSIZE);
+      memcpy (dst + op, src, lit_len);
+      src += lit_len;
+      op += lit_len;
+      if (op == PGSIZE)
+        {
+          return;
+        }
+
+      size_t offset = src[0] | (src[1] << 8);
+      src += 2;
+      size_t match_len = token & 0xf;
+      if (match_len == 15)
+        {
+          match_len += get_length (&src);
+        }
+      match_len += MIN_MATCH;
+      ASSERT (offset > 0 && offset <= op && op + match_len <= PGSIZE);
+
+      /* The match may overlap the bytes it produces, so copy byte by byte. */
+      size_t i;
+      for (i = 0; i < match_len; i++, op++)
+        {
+          dst[op] = dst[op - offset];
+        }
+    }
+}
+
+/* hash_hash_func for compressed pages, hashing the slot. */
+static unsigned
+page_hash_func (const struct hash_elem *e, void *aux UNUSED)
+{
+  return hash_int (hash_entry (e, struct compressed_page, elem)->slot);
+}
+
+/* hash_less_func for compressed pages, comparing slots. */
+static bool
+page_less_func (const struct hash_elem *a, const struct hash_elem *b,
+                void *aux UNUSED)
+{
+  return hash_entry (a, struct compressed_page, elem)->slot
+    < hash_entry (b, struct compressed_page, elem)->slot;
+}
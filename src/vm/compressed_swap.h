@@ -0,0 +1,18 @@
+#ifndef VM_COMPRESSED_SWAP_H
+#define VM_COMPRESSED_SWAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <vm/swap.h>
+
+/* Default number of kernel pages holding compressed swapped out pages. */
+#define COMPRESSED_SWAP_PAGES 32
+
+void compressed_swap_init (size_t pool_pages);
+bool compressed_swap_store (slot_no slot, const void *kpage);
+bool compressed_swap_load (slot_no slot, void *kpage);
+bool compressed_swap_invalidate (slot_no slot);
+void compressed_swap_print_stats (void);
+
+#endif /* vm/compressed_swap.h */
@@ -3,32 +3,86 @@
 #include <debug.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
-#include <lib/kernel/hash.h>
-#include <lib/kernel/list.h>
 #include <threads/malloc.h>
 #include <threads/palloc.h>
 #include <threads/synch.h>
 #include <threads/thread.h>
+#include <threads/vaddr.h>
 
+#include "devices/block.h"
+#include "vm/shared_page.h"
 #include "vm/swap.h"
 #include "vm/supp_page.h"
 #include "userprog/pagedir.h"
 #include "threads/interrupt.h"
 
+/* Number of classes frames are ranked in when choosing a victim. */
+#define NRU_CLASSES 4
+/* How many further frames the clock may examine for a clean victim, once it
+   has found a victim that needs writing out. */
+#define CLEAN_SEARCH_LIMIT 64
+/* Maximum number of frames waiting to be cleaned by the pageout daemon. */
+#define CLEAN_QUEUE_SIZE 16
+/* Maximum number of pages the pageout daemon writes to swap together. */
+#define SWAP_CLUSTER_SIZE 8
+
 /* The frame table keeps track of frames that are currently in use.
-   Uses redundant data-structures in order to provide quick look-up
-   (hash table) alongside efficient eviction (queue).
+   Frame descriptors live in a flat array with one entry per frame of the user
+   pool, so that looking up the descriptor for a kpage is a simple index
+   calculation and no memory is allocated on the page fault path. The same
+   array doubles as the circular buffer of the clock used for eviction.
    All provided external functions are self-synchronising. */
 struct frame_table
 {
   struct lock table_lock; /* Synchronizes table between threads. */
-  struct hash allocated;  /* Frames which have been allocated already. */
-  /* Mirrors the above hash. Organises frames for page eviction. */
-  struct list eviction_queue;
+  struct frame *table;    /* One descriptor per frame in the user pool. */
+  uint8_t *base;          /* Kernel virtual address of the first frame. */
+  size_t frame_cnt;       /* Number of frames in the user pool. */
+  /* Number of frames currently allocated, including those in transit. */
+  size_t allocated_cnt;
+  size_t in_transit_cnt;  /* Number of frames currently being evicted. */
+  size_t clock_hand;      /* Index of the next frame the clock considers. */
+  /* Most frames a process may hold before it must replace its own pages, or 0
+     if processes are not limited. */
+  size_t resident_limit;
   /* Condition used to wait for a frame to be either unpinned or freed. */
   struct condition wait_table_changes;
   unsigned pinned_frames; /* Count of currently pinned frames. */
+  /* Condition used to wake the pageout daemon when free frames run low. */
+  struct condition pageout_needed;
+  size_t low_watermark;  /* Pageout starts below this many free frames. */
+  size_t high_watermark; /* Pageout stops once this many frames are free. */
+  /* Ring buffer of frames for the pageout daemon to clean. */
+  struct frame *clean_queue[CLEAN_QUEUE_SIZE];
+  size_t clean_start;    /* Index of the first frame in clean_queue. */
+  size_t clean_cnt;      /* Number of frames in clean_queue. */
+};
+
+/* Statistics about the clock, used to diagnose slow evictions. */
+struct clock_stats
+{
+  long long evictions;      /* Number of frames evicted. */
+  long long frames_scanned; /* Frames examined by the hand, in total. */
+  long long hand_laps;      /* Times the hand wrapped around the table. */
+  size_t longest_scan;      /* Most frames examined in a single eviction. */
+  long long pageout_evictions; /* Evictions done by the pageout daemon. */
+  long long clean_evictions; /* Evictions which did not need any I/O. */
+  long long pages_cleaned;  /* Dirty pages written back by the daemon. */
+  long long local_evictions; /* Evictions of a process' own pages. */
+  long long swap_clusters;  /* Batches of pages written to swap together. */
+  long long clustered_pages; /* Pages written to swap in those batches. */
+};
+
+/* The states a frame can be in. */
+enum frame_state
+{
+  FRAME_FREE,      /* Not holding any page. */
+  FRAME_IN_USE,    /* Holding a page, which may be mapped by its owner. */
+  /* Unmapped from its owner, with its contents being written out. Only the
+     evicting thread may touch a frame in this state. */
+  FRAME_IN_TRANSIT
 };
 
 /* Meta-data about a frame. A frame is a physical storage unit in memory,
@@ -36,38 +90,99 @@ struct frame_table
    virtual addresses may differ from the actual physical address. */
 struct frame
 {
-  struct hash_elem frame_elem; /* For placing frames inside frame_tables. */
-  struct list_elem eviction_elem; /* For placing frames into eviction_queue. */
+  enum frame_state state; /* What the frame is currently being used for. */
   bool pinned;  /* Indicates whether frame is pinned (cannot be evicted) */
+  bool clean_queued; /* Whether the frame is in the clean queue. */
   uint32_t *pd; /* The owner thread's page directory. */
   /* Pointer to the page's entry in the supplementary page table. */
   struct supp_page_mapping *mapped;
+  /* The shared page held by the frame, if it is shared between processes, in
+     which case pd, mapped and owner are NULL. */
+  struct shared_page *shared;
+  /* The supplementary page table of the process the frame counts towards. */
+  struct supp_page_table *owner;
   void *kpage;  /* The kernel virtual address of the frame. */
 };
 
 static struct frame *allocated_find_frame (void *kpage);
-static unsigned allocated_hash_func (const struct hash_elem *e, void *aux UNUSED);
-static bool allocated_less_func (const struct hash_elem *a,
-                                 const struct hash_elem *b,
-                                 void *aux UNUSED);
-static struct frame *frame_from_hash_elem (const struct hash_elem *e);
-static void *evict_frame (void);
+static struct frame *frame_from_kpage (void *kpage);
+static struct frame *allocate_frame (enum palloc_flags additional_flags,
+                                     struct supp_page_table *owner);
+static struct frame *evict_frame (struct supp_page_table *owner);
+static struct frame *evict_frame_begin (struct supp_page_table *owner);
+static bool evict_frame_write (struct frame *f);
+static void evict_frame_end (struct frame *f, bool wrote);
+static bool evict_frame_needs_io (struct frame *f);
+static void swap_out_cluster (struct frame **cluster, size_t cnt);
+static bool frame_page_less (struct frame *a, struct frame *b);
+static struct frame *clock_select_victim (struct supp_page_table *owner);
+static void clock_advance_hand (size_t *hand);
+static void frame_disown (struct frame *f);
+static bool frame_is_accessed (struct frame *f);
+static void frame_clear_accessed (struct frame *f);
+static bool frame_try_lock_page (struct frame *f);
+static void frame_unlock_page (struct frame *f);
+static void clean_queue_push (struct frame *f);
+static void clean_frame (struct frame *f);
 static void free_frame_stat (struct frame *frame);
-static struct frame *frame_from_eviction_elem (const struct list_elem *e);
+static size_t free_frame_cnt (void);
+static size_t evictable_frame_cnt (void);
+static bool pageout_can_evict (void);
+static bool pageout_evict_cluster (void);
+static void pageout_free_frame (struct frame *f);
+static void pageout_daemon (void *aux UNUSED);
 
 static struct frame_table frames;
+static struct clock_stats clock_stats;
 
-/* Initializes the frame table. */
+/* Initializes the frame table.
+   A pageout daemon is started which evicts frames in the background whenever
+   fewer than LOW_WATERMARK frames are free, until HIGH_WATERMARK frames are
+   free. A LOW_WATERMARK of 0 disables the daemon.
+   Each process may hold at most RESIDENT_LIMIT frames before it has to replace
+   its own pages. A RESIDENT_LIMIT of 0 means processes are not limited. */
 void
-frame_init (void)
+frame_init (size_t low_watermark, size_t high_watermark,
+            size_t resident_limit)
 {
   lock_init (&frames.table_lock);
   lock_acquire (&frames.table_lock);
-  hash_init (&frames.allocated, allocated_hash_func, allocated_less_func, NULL);
-  list_init (&frames.eviction_queue);
+  frames.base = palloc_user_pool_base ();
+  frames.frame_cnt = palloc_user_pool_size ();
+  frames.allocated_cnt = 0;
+  frames.in_transit_cnt = 0;
+  frames.table = try_calloc (frames.frame_cnt, sizeof *frames.table);
+  size_t i;
+  for (i = 0; i < frames.frame_cnt; i++)
+    {
+      frames.table[i].state = FRAME_FREE;
+      frames.table[i].kpage = frames.base + i * PGSIZE;
+    }
+  frames.clock_hand = 0;
+  frames.resident_limit = resident_limit;
   cond_init (&frames.wait_table_changes);
   frames.pinned_frames = 0;
+  cond_init (&frames.pageout_needed);
+  frames.clean_start = 0;
+  frames.clean_cnt = 0;
+
+  /* Never try to keep more than half of user memory free. */
+  if (high_watermark > frames.frame_cnt / 2)
+    {
+      high_watermark = frames.frame_cnt / 2;
+    }
+  if (low_watermark > high_watermark)
+    {
+      low_watermark = high_watermark;
+    }
+  frames.low_watermark = low_watermark;
+  frames.high_watermark = high_watermark;
   lock_release (&frames.table_lock);
+
+  if (frames.low_watermark > 0)
+    {
+      thread_create ("pageout", PRI_DEFAULT, pageout_daemon, NULL);
+    }
 }
 
 /* Returns the address of an available frame from the user pool.
@@ -79,39 +194,115 @@ void *
 request_frame (enum palloc_flags additional_flags,
                struct supp_page_mapping *mapped)
 {
+  struct supp_page_table *owner = &thread_current ()->supp_page_table;
+  lock_acquire (&frames.table_lock);
+  struct frame *frame = allocate_frame (additional_flags, owner);
+  frame->mapped = mapped;
+  frame->pd = thread_current ()->pagedir;
+  frame->owner = owner;
+  ++owner->resident_cnt;
+  lock_release (&frames.table_lock);
+
+  return frame->kpage;
+}
+
+/* Like request_frame, but for a page shared between processes. The frame is
+   pinned, and the caller must hold the shared page's lock. */
+void *
+request_shared_frame (struct shared_page *shared)
+{
+  ASSERT (lock_held_by_current_thread (&shared->lock));
   lock_acquire (&frames.table_lock);
-  /* For now, evict pages out of the system. */
-  void *page;
-  do
+  struct frame *frame = allocate_frame (PAL_NONE, NULL);
+  frame->shared = shared;
+  lock_release (&frames.table_lock);
+
+  return frame->kpage;
+}
+
+/* Allocates a frame from the user pool, evicting a frame if there are none
+   free, and waiting if no frame can be evicted. If OWNER is already at the
+   resident limit, one of its own frames is evicted instead, when possible.
+   The frame is returned in use and pinned, but without an owner. */
+static struct frame *
+allocate_frame (enum palloc_flags additional_flags,
+                struct supp_page_table *owner)
+{
+  ASSERT (lock_held_by_current_thread (&frames.table_lock));
+  struct frame *frame = NULL;
+  if (owner != NULL && frames.resident_limit > 0
+      && owner->resident_cnt >= frames.resident_limit)
     {
-      page = palloc_get_page (additional_flags | PAL_USER);
-      if (page == NULL)
+      frame = evict_frame (owner);
+      if (frame != NULL)
         {
-          if (frames.pinned_frames >= hash_size (&frames.allocated))
+          --frames.in_transit_cnt;
+          ++clock_stats.local_evictions;
+          if (additional_flags & PAL_ZERO)
             {
-              ASSERT (frames.pinned_frames == hash_size (&frames.allocated));
-              /* If all pages are pinned and no page could be allocated, we must
-                 wait for some thread to either unpin free one. */
-              cond_wait (&frames.wait_table_changes, &frames.table_lock);
+              memset (frame->kpage, 0, PGSIZE);
             }
-          else
+        }
+    }
+
+  while (frame == NULL)
+    {
+      void *page = palloc_get_page (additional_flags | PAL_USER);
+      if (page != NULL)
+        {
+          frame = frame_from_kpage (page);
+          ASSERT (frame->state == FRAME_FREE);
+          ++frames.allocated_cnt;
+        }
+      else if (evictable_frame_cnt () > 0)
+        {
+          frame = evict_frame (NULL);
+          if (frame != NULL)
             {
-              page = evict_frame ();
+              --frames.in_transit_cnt;
+              if (additional_flags & PAL_ZERO)
+                {
+                  memset (frame->kpage, 0, PGSIZE);
+                }
             }
         }
-    } while (page == NULL);
 
-  struct frame *frame = try_calloc (1, sizeof *frame);
+      if (frame == NULL)
+        {
+          /* If all pages are pinned or being evicted by other threads and no
+             page could be allocated, we must wait for some thread to either
+             unpin or free one. */
+          cond_wait (&frames.wait_table_changes, &frames.table_lock);
+        }
+    }
+
+  frame->state = FRAME_IN_USE;
   frame->pinned = true;
   ++frames.pinned_frames;
-  frame->kpage = page;
-  frame->mapped = mapped;
-  frame->pd = thread_current ()->pagedir;
-  hash_insert (&frames.allocated, &frame->frame_elem);
-  list_push_back (&frames.eviction_queue, &frame->eviction_elem);
-  lock_release (&frames.table_lock);
+  frame->mapped = NULL;
+  frame->pd = NULL;
+  frame->shared = NULL;
+  if (free_frame_cnt () < frames.low_watermark)
+    {
+      cond_signal (&frames.pageout_needed, &frames.table_lock);
+    }
+  return frame;
+}
 
-  return frame->kpage;
+/* Whether the current process could be given another frame without anything
+   being evicted, either to keep free frames above the low watermark or to
+   keep the process within its resident limit. Used to bound speculative page
+   loads. */
+bool
+frame_has_spare (void)
+{
+  struct supp_page_table *owner = &thread_current ()->supp_page_table;
+  lock_acquire (&frames.table_lock);
+  bool spare = free_frame_cnt () > frames.low_watermark
+    && (frames.resident_limit == 0
+        || owner->resident_cnt < frames.resident_limit);
+  lock_release (&frames.table_lock);
+  return spare;
 }
 
 /* Pins the frame in the frame table corresponding to the kpage. */
@@ -143,49 +334,393 @@ unpin_frame (void *kpage)
   lock_release(&frames.table_lock);
 }
 
-/* Selects a frame from frames and evicts it to the swap table (or writes it to
-   disk, if the page was a mmapped file), using the second chance algorithm. */
-static void *
-evict_frame (void)
+/* Selects a frame using the clock algorithm and evicts it. Pages of mmapped
+   files are written back to their file if dirty, other pages which have
+   diverged from their file or zeroes are written to the swap table, and the
+   rest are simply dropped.
+
+   The victim is unmapped from its owner and marked as in transit while the
+   table lock is held, but its contents are written out with the table lock
+   released, so that other threads can allocate, pin and free frames in the
+   meantime. The page's eviction_lock is held for the whole write, so a fault
+   on the page being evicted waits for that page only.
+
+   If OWNER is not NULL, only frames counting towards that process are
+   considered.
+
+   Returns the evicted frame, still in transit and counted as allocated, with
+   the table lock held again. Returns NULL if no frame could be evicted. */
+static struct frame *
+evict_frame (struct supp_page_table *owner)
+{
+  ASSERT (lock_held_by_current_thread (&frames.table_lock));
+
+  struct frame *f = evict_frame_begin (owner);
+  if (f == NULL || f->mapped == NULL)
+    {
+      return f;
+    }
+  lock_release (&frames.table_lock);
+  bool wrote = evict_frame_write (f);
+  lock_acquire (&frames.table_lock);
+  evict_frame_end (f, wrote);
+  return f;
+}
+
+/* Selects a victim using the clock algorithm, marks it as in transit and
+   unmaps it, leaving its page locked. Shared frames are evicted completely,
+   and are returned without a mapped page.
+   Returns NULL if no frame could be chosen. */
+static struct frame *
+evict_frame_begin (struct supp_page_table *owner)
+{
+  ASSERT (lock_held_by_current_thread (&frames.table_lock));
+
+  /* The victim's page is already locked on return. */
+  struct frame *f = clock_select_victim (owner);
+  if (f == NULL)
+    {
+      return NULL;
+    }
+  f->state = FRAME_IN_TRANSIT;
+  ++frames.in_transit_cnt;
+  if (f->shared != NULL)
+    {
+      /* Shared pages are read-only, so can always be dropped. */
+      shared_page_unmap_all (f->shared);
+      lock_release (&f->shared->lock);
+      f->shared = NULL;
+      ++clock_stats.clean_evictions;
+      return f;
+    }
+  frame_disown (f);
+  if (f->mapped->swap_readahead)
+    {
+      bool used = pagedir_is_accessed (f->pd, f->mapped->uaddr);
+      supp_page_readahead_result (f->mapped, used);
+    }
+  pagedir_clear_page (f->pd, f->mapped->uaddr);
+  return f;
+}
+
+/* Writes out the page held by F, which evict_frame_begin() chose, and unlocks
+   the page. If the page is a mapped file, changes are written to file.
+   Otherwise, the page is swapped out if it cannot be recreated.
+   Returns whether anything was written. */
+static bool
+evict_frame_write (struct frame *f)
+{
+  struct supp_page_mapping *mapped = f->mapped;
+  slot_no slot = NOT_SWAP;
+  bool wrote = false;
+  if (supp_page_is_mmapped (mapped))
+    {
+      wrote = supp_page_write_mmapped (f->pd, mapped, f->kpage);
+    }
+  else if (supp_page_needs_write_back (f->pd, mapped))
+    {
+      slot = swap_write (f->kpage);
+      wrote = true;
+    }
+  supp_page_swap_out (mapped, slot);
+  lock_release (&mapped->eviction_lock);
+  return wrote;
+}
+
+/* Finishes evicting F once its page has been written out. WROTE is whether
+   that needed any I/O. */
+static void
+evict_frame_end (struct frame *f, bool wrote)
+{
+  ASSERT (lock_held_by_current_thread (&frames.table_lock));
+  if (!wrote)
+    {
+      ++clock_stats.clean_evictions;
+    }
+  f->mapped = NULL;
+  f->pd = NULL;
+}
+
+/* Whether writing out the page of F, which evict_frame_begin() chose, needs
+   any I/O. */
+static bool
+evict_frame_needs_io (struct frame *f)
+{
+  return f->mapped != NULL && supp_page_needs_write_back (f->pd, f->mapped);
+}
+
+/* Writes the pages of the CNT frames in CLUSTER, which evict_frame_begin()
+   chose, to swap together and unlocks them. The pages are sorted by process
+   and address first, so that neighbouring pages get neighbouring slots. */
+static void
+swap_out_cluster (struct frame **cluster, size_t cnt)
+{
+  ASSERT (cnt <= SWAP_CLUSTER_SIZE);
+  size_t i;
+  for (i = 1; i < cnt; i++)
+    {
+      struct frame *f = cluster[i];
+      size_t j = i;
+      while (j > 0 && frame_page_less (f, cluster[j - 1]))
+        {
+          cluster[j] = cluster[j - 1];
+          --j;
+        }
+      cluster[j] = f;
+    }
+
+  void *kpages[SWAP_CLUSTER_SIZE];
+  slot_no slots[SWAP_CLUSTER_SIZE];
+  for (i = 0; i < cnt; i++)
+    {
+      kpages[i] = cluster[i]->kpage;
+    }
+  swap_write_cluster (kpages, cnt, slots);
+  for (i = 0; i < cnt; i++)
+    {
+      supp_page_swap_out (cluster[i]->mapped, slots[i]);
+      lock_release (&cluster[i]->mapped->eviction_lock);
+    }
+}
+
+/* Orders frames by the process they belong to, then by user address. */
+static bool
+frame_page_less (struct frame *a, struct frame *b)
+{
+  if (a->pd != b->pd)
+    {
+      return a->pd < b->pd;
+    }
+  return a->mapped->uaddr < b->mapped->uaddr;
+}
+
+/* Sweeps the clock hand over the frame table looking for a victim, clearing
+   the accessed bits of frames it passes over (enhanced second chance).
+   Unpinned frames are ranked by whether they were accessed since the hand
+   last passed them and whether evicting them requires a write, from cheapest
+   to most expensive:
+
+     0: not accessed, clean     2: accessed, clean
+     1: not accessed, dirty     3: accessed, dirty
+
+   The sweep stops at the first frame of class 0. Otherwise it continues for at
+   most CLEAN_SEARCH_LIMIT frames once a frame of class 1 has been found, and
+   for at most a single lap of the table, then takes the cheapest frame seen.
+   Dirty mmapped frames that are passed over are queued for cleaning by the
+   pageout daemon, so they are cheap to evict next time.
+
+   Frames whose page is locked by another thread (being faulted in or freed)
+   are skipped. The chosen frame's page is locked on return.
+   If OWNER is not NULL, only frames counting towards that process are
+   considered, using the process' own clock hand.
+   Returns NULL if no frame could be chosen. */
+static struct frame *
+clock_select_victim (struct supp_page_table *owner)
+{
+  ASSERT (lock_held_by_current_thread (&frames.table_lock));
+
+  size_t *hand = owner != NULL ? &owner->clock_hand : &frames.clock_hand;
+  struct frame *victim = NULL;
+  int victim_class = NRU_CLASSES;
+  size_t scanned = 0;
+  size_t search_limit = frames.frame_cnt;
+  while (victim_class > 0 && scanned < search_limit)
+    {
+      struct frame *f = &frames.table[*hand];
+      clock_advance_hand (hand);
+      ++scanned;
+      if (f->state != FRAME_IN_USE || f->pinned
+          || (owner != NULL && f->owner != owner))
+        {
+          continue;
+        }
+
+      bool accessed = frame_is_accessed (f);
+      bool dirty = f->shared == NULL
+        && supp_page_needs_write_back (f->pd, f->mapped);
+      int class = (accessed ? 2 : 0) + (dirty ? 1 : 0);
+      if (accessed)
+        {
+          frame_clear_accessed (f);
+        }
+      if (dirty && f->mapped->cached_slot_no != NOT_SWAP
+          && frame_try_lock_page (f))
+        {
+          supp_page_drop_cached_slot (f->pd, f->mapped);
+          frame_unlock_page (f);
+        }
+
+      if (class < victim_class && frame_try_lock_page (f))
+        {
+          if (victim != NULL)
+            {
+              clean_queue_push (victim);
+              frame_unlock_page (victim);
+            }
+          victim = f;
+          victim_class = class;
+          if (class == 1 && scanned + CLEAN_SEARCH_LIMIT < search_limit)
+            {
+              search_limit = scanned + CLEAN_SEARCH_LIMIT;
+            }
+        }
+      else
+        {
+          clean_queue_push (f);
+        }
+    }
+  if (victim == NULL)
+    {
+      return NULL;
+    }
+
+  ++clock_stats.evictions;
+  clock_stats.frames_scanned += scanned;
+  if (scanned > clock_stats.longest_scan)
+    {
+      clock_stats.longest_scan = scanned;
+    }
+  return victim;
+}
+
+/* Queues a frame passed over by the clock to be cleaned by the pageout daemon,
+   if it holds a dirty mmapped page and there is room in the queue. */
+static void
+clean_queue_push (struct frame *f)
+{
+  ASSERT (lock_held_by_current_thread (&frames.table_lock));
+  if (f->clean_queued || frames.clean_cnt == CLEAN_QUEUE_SIZE
+      || f->shared != NULL || !supp_page_is_mmapped (f->mapped)
+      || !pagedir_is_dirty (f->pd, f->mapped->uaddr))
+    {
+      return;
+    }
+  f->clean_queued = true;
+  frames.clean_queue[(frames.clean_start + frames.clean_cnt) % CLEAN_QUEUE_SIZE]
+    = f;
+  ++frames.clean_cnt;
+  cond_signal (&frames.pageout_needed, &frames.table_lock);
+}
+
+/* Writes back the page in a frame taken from the clean queue, leaving it
+   mapped. The frame is pinned, and its page's eviction_lock held, while the
+   table lock is released for the write. */
+static void
+clean_frame (struct frame *f)
 {
   ASSERT (lock_held_by_current_thread (&frames.table_lock));
-  ASSERT (!list_empty (&frames.eviction_queue));
+  f->clean_queued = false;
+  if (f->state != FRAME_IN_USE || f->pinned || f->shared != NULL
+      || !lock_try_acquire (&f->mapped->eviction_lock))
+    {
+      return;
+    }
+  struct supp_page_mapping *mapped = f->mapped;
+  uint32_t *pd = f->pd;
+  f->pinned = true;
+  ++frames.pinned_frames;
+  lock_release (&frames.table_lock);
 
-  struct list_elem *e = list_front(&frames.eviction_queue);
-  struct frame *f = frame_from_eviction_elem (e);
+  bool cleaned = supp_page_clean_mmapped (pd, mapped, f->kpage);
+  lock_release (&mapped->eviction_lock);
 
-  while (e != list_end (&frames.eviction_queue)
-         && (pagedir_is_accessed (f->pd, f->mapped->uaddr)
-             || f->pinned))
+  lock_acquire (&frames.table_lock);
+  if (cleaned)
+    {
+      ++clock_stats.pages_cleaned;
+    }
+  f->pinned = false;
+  --frames.pinned_frames;
+  cond_signal (&frames.wait_table_changes, &frames.table_lock);
+}
+
+/* Whether the page in the frame has been accessed since the clock last
+   cleared its accessed bit, by any process mapping it. */
+static bool
+frame_is_accessed (struct frame *f)
+{
+  if (f->shared != NULL)
+    {
+      return shared_page_is_accessed (f->shared);
+    }
+  return pagedir_is_accessed (f->pd, f->mapped->uaddr);
+}
+
+/* Clears the accessed bit of the page in the frame, for every process mapping
+   it. */
+static void
+frame_clear_accessed (struct frame *f)
+{
+  if (f->shared != NULL)
+    {
+      shared_page_clear_accessed (f->shared);
+    }
+  else
     {
       pagedir_set_accessed (f->pd, f->mapped->uaddr, false);
-      e = list_next (e);
-      f = frame_from_eviction_elem (e);
-      list_push_back (&frames.eviction_queue,
-                       list_pop_front (&frames.eviction_queue));
+      if (f->mapped->swap_readahead)
+        {
+          supp_page_readahead_result (f->mapped, true);
+        }
     }
+}
 
-  void *page = f->kpage;
-  lock_acquire (&f->mapped->eviction_lock);
-  pagedir_clear_page (f->pd, f->mapped->uaddr);
+/* Tries to lock the page held in the frame against being faulted in or freed,
+   without waiting. Returns true if the lock was acquired. */
+static bool
+frame_try_lock_page (struct frame *f)
+{
+  if (f->shared != NULL)
+    {
+      return lock_try_acquire (&f->shared->lock);
+    }
+  return lock_try_acquire (&f->mapped->eviction_lock);
+}
 
-  /* If the page is a mapped file, changes are written to file.
-     Otherwise, the page is swapped out. */
-  if (!supp_page_write_mmapped (f->pd, f->mapped))
+/* Releases the lock taken by frame_try_lock_page. */
+static void
+frame_unlock_page (struct frame *f)
+{
+  if (f->shared != NULL)
     {
-      supp_page_swap_out (f->mapped, swap_write (page));
+      lock_release (&f->shared->lock);
     }
   else
     {
-      supp_page_swap_out (f->mapped, NOT_SWAP);
+      lock_release (&f->mapped->eviction_lock);
     }
-  lock_release (&f->mapped->eviction_lock);
-  free_frame_stat (f);
+}
 
-  return page;
+/* Moves a clock hand on to the next frame, wrapping around at the end of the
+   table. Only laps of the global hand are counted. */
+static void
+clock_advance_hand (size_t *hand)
+{
+  ASSERT (lock_held_by_current_thread (&frames.table_lock));
+  if (++*hand >= frames.frame_cnt)
+    {
+      *hand = 0;
+      if (hand == &frames.clock_hand)
+        {
+          ++clock_stats.hand_laps;
+        }
+    }
+}
+
+/* Stops the frame counting towards the resident set of its owner. */
+static void
+frame_disown (struct frame *f)
+{
+  ASSERT (lock_held_by_current_thread (&frames.table_lock));
+  if (f->owner != NULL)
+    {
+      ASSERT (f->owner->resident_cnt > 0);
+      --f->owner->resident_cnt;
+      f->owner = NULL;
+    }
 }
 
-/* Frees the page held inside the frame, and the given struct frame itself. */
+/* Frees the page held inside the frame, and marks the frame as unused. */
 void
 free_frame (void *kpage)
 {
@@ -195,85 +730,230 @@ free_frame (void *kpage)
     }
   lock_acquire (&frames.table_lock);
   struct frame *frame = allocated_find_frame (kpage);
-  if (frame->pinned)
+  if (frame != NULL)
     {
-      --frames.pinned_frames;
+      if (frame->pinned)
+        {
+          --frames.pinned_frames;
+        }
+      free_frame_stat (frame);
+      palloc_free_page (kpage);
+      cond_signal (&frames.wait_table_changes, &frames.table_lock);
     }
-  palloc_free_page (kpage);
-  free_frame_stat (frame);
-  cond_signal (&frames.wait_table_changes, &frames.table_lock);
   lock_release (&frames.table_lock);
 }
 
-/* Removes the frame from the frame list and the frame hash. */
+/* Marks the descriptor of the frame as unused. */
 static void
 free_frame_stat (struct frame *frame)
 {
   ASSERT (lock_held_by_current_thread (&frames.table_lock));
   if (frame != NULL)
     {
-      hash_delete (&frames.allocated, &frame->frame_elem);
-      list_remove (&frame->eviction_elem);
-      free (frame);
+      frame_disown (frame);
+      frame->state = FRAME_FREE;
+      frame->pinned = false;
+      frame->mapped = NULL;
+      frame->pd = NULL;
+      frame->shared = NULL;
+      --frames.allocated_cnt;
     }
 }
 
-/* Finds the frame from the allocated hash table, given the kernel virtual
+/* Finds the descriptor of an allocated frame, given the kernel virtual
    address of the frame.
-   Returns NULL if not found. */
+   Returns NULL if the frame is not currently in use. Frames in transit are
+   owned by the evicting thread, so are not returned either. */
 static struct frame *
 allocated_find_frame (void *kpage)
+{
+  struct frame *frame = frame_from_kpage (kpage);
+  return frame->state == FRAME_IN_USE ? frame : NULL;
+}
+
+/* Returns the descriptor of the frame at kernel virtual address KPAGE, which
+   must lie in the user pool. */
+static struct frame *
+frame_from_kpage (void *kpage)
 {
   ASSERT (lock_held_by_current_thread (&frames.table_lock));
-  struct frame for_hashing;
-  for_hashing.kpage = kpage;
+  ASSERT (pg_ofs (kpage) == 0);
+  ASSERT ((uint8_t *)kpage >= frames.base);
 
-  struct hash_elem *found_elem = hash_find (&frames.allocated,
-                                            &for_hashing.frame_elem);
-  if (found_elem == NULL)
-    {
-      return NULL;
-    }
+  size_t index = pg_no (kpage) - pg_no (frames.base);
+  ASSERT (index < frames.frame_cnt);
+  return &frames.table[index];
+}
 
-  return frame_from_hash_elem (found_elem);
+/* Number of frames in the user pool which are not allocated. */
+static size_t
+free_frame_cnt (void)
+{
+  ASSERT (lock_held_by_current_thread (&frames.table_lock));
+  return frames.frame_cnt - frames.allocated_cnt;
 }
 
-/* allocated hash function */
-static unsigned
-allocated_hash_func (const struct hash_elem *e, void *aux UNUSED)
+/* Number of allocated frames which are neither pinned nor already being
+   evicted. */
+static size_t
+evictable_frame_cnt (void)
 {
   ASSERT (lock_held_by_current_thread (&frames.table_lock));
-  void *kpage = frame_from_hash_elem (e)->kpage;
-  /* sizeof returns how many bytes kpage, the pointer itself (not what it is
-     pointing to), takes up. */
-  return hash_bytes (&kpage, sizeof kpage);
+  ASSERT (frames.pinned_frames + frames.in_transit_cnt <= frames.allocated_cnt);
+  return frames.allocated_cnt - frames.pinned_frames - frames.in_transit_cnt;
 }
 
-/* allocated less than function */
+/* Whether the pageout daemon should (and can) evict a frame right now. */
 static bool
-allocated_less_func (const struct hash_elem *a, const struct hash_elem *b,
-                     void *aux UNUSED)
+pageout_can_evict (void)
 {
   ASSERT (lock_held_by_current_thread (&frames.table_lock));
-  void *kpage_a = frame_from_hash_elem (a)->kpage;
-  void *kpage_b = frame_from_hash_elem (b)->kpage;
-  return kpage_a < kpage_b;
+  return free_frame_cnt () < frames.high_watermark
+    && evictable_frame_cnt () > 0;
 }
 
-/* Wrapper function for the hash_entry macro, specific to frame_table.allocated */
-static struct frame *
-frame_from_hash_elem (const struct hash_elem *e)
+/* Body of the pageout kernel thread. Sleeps until the number of free frames
+   drops below the low watermark, then evicts frames back to the free pool until
+   the high watermark is reached, so that page faults rarely have to evict
+   synchronously. Also cleans the dirty pages queued by the clock. Its writes
+   yield to page faults and to file I/O. */
+static void
+pageout_daemon (void *aux UNUSED)
+{
+  block_set_io_class (BLOCK_IO_BACKGROUND);
+  lock_acquire (&frames.table_lock);
+  for (;;)
+    {
+      while (frames.clean_cnt == 0
+             && (free_frame_cnt () >= frames.low_watermark
+                 || !pageout_can_evict ()))
+        {
+          cond_wait (&frames.pageout_needed, &frames.table_lock);
+        }
+      while (frames.clean_cnt > 0)
+        {
+          struct frame *frame = frames.clean_queue[frames.clean_start];
+          frames.clean_start = (frames.clean_start + 1) % CLEAN_QUEUE_SIZE;
+          --frames.clean_cnt;
+          clean_frame (frame);
+        }
+      if (free_frame_cnt () >= frames.low_watermark)
+        {
+          continue;
+        }
+      while (pageout_can_evict ())
+        {
+          if (!pageout_evict_cluster ())
+            {
+              /* Every candidate is busy, so wait to be woken again. */
+              cond_wait (&frames.pageout_needed, &frames.table_lock);
+            }
+        }
+      cond_broadcast (&frames.wait_table_changes, &frames.table_lock);
+    }
+}
+
+/* Evicts a batch of frames for the pageout daemon and frees them. Victims
+   which have to be swapped out are collected into a cluster of up to
+   SWAP_CLUSTER_SIZE pages, which are written to swap together. Victims which
+   need no I/O are freed straight away, and a victim which has to be written
+   back to its file ends the batch, and is written out after the cluster.
+   Returns false if no frame could be evicted. */
+static bool
+pageout_evict_cluster (void)
 {
   ASSERT (lock_held_by_current_thread (&frames.table_lock));
-  ASSERT (e != NULL);
-  return hash_entry (e, struct frame, frame_elem);
+
+  struct frame *cluster[SWAP_CLUSTER_SIZE];
+  size_t cnt = 0;
+  struct frame *other = NULL;
+  bool evicted = false;
+  while (cnt < SWAP_CLUSTER_SIZE && other == NULL
+         && free_frame_cnt () + cnt < frames.high_watermark
+         && evictable_frame_cnt () > 0)
+    {
+      struct frame *f = evict_frame_begin (NULL);
+      if (f == NULL)
+        {
+          break;
+        }
+      evicted = true;
+      if (!evict_frame_needs_io (f))
+        {
+          /* Nothing is written, so the table lock can stay held. */
+          if (f->mapped != NULL)
+            {
+              evict_frame_end (f, evict_frame_write (f));
+            }
+          pageout_free_frame (f);
+        }
+      else if (supp_page_is_mmapped (f->mapped))
+        {
+          other = f;
+        }
+      else
+        {
+          cluster[cnt++] = f;
+        }
+    }
+  if (cnt == 0 && other == NULL)
+    {
+      return evicted;
+    }
+
+  /* Writing back to a file may need the file system lock, which a thread
+     faulting on a page of the cluster may hold, so the cluster is written and
+     unlocked first. */
+  lock_release (&frames.table_lock);
+  if (cnt > 0)
+    {
+      swap_out_cluster (cluster, cnt);
+    }
+  bool wrote = other != NULL && evict_frame_write (other);
+  lock_acquire (&frames.table_lock);
+
+  size_t i;
+  for (i = 0; i < cnt; i++)
+    {
+      evict_frame_end (cluster[i], true);
+      pageout_free_frame (cluster[i]);
+    }
+  if (cnt > 0)
+    {
+      ++clock_stats.swap_clusters;
+      clock_stats.clustered_pages += cnt;
+    }
+  if (other != NULL)
+    {
+      evict_frame_end (other, wrote);
+      pageout_free_frame (other);
+    }
+  return true;
 }
 
-/* Wrapper for the list_entry macro, specific to frame_table.eviction_queue. */
-static struct frame *
-frame_from_eviction_elem (const struct list_elem *e)
+/* Returns a frame evicted by the pageout daemon to the free pool. */
+static void
+pageout_free_frame (struct frame *f)
 {
   ASSERT (lock_held_by_current_thread (&frames.table_lock));
-  ASSERT (e != NULL);
-  return list_entry (e, struct frame, eviction_elem);
+  --frames.in_transit_cnt;
+  free_frame_stat (f);
+  palloc_free_page (f->kpage);
+  ++clock_stats.pageout_evictions;
+}
+
+/* Prints statistics about eviction. */
+void
+frame_print_stats (void)
+{
+  printf ("Frames: %lld evictions (%lld by pageout, %lld local, "
+          "%lld without I/O), %lld pages cleaned\n",
+          clock_stats.evictions, clock_stats.pageout_evictions,
+          clock_stats.local_evictions, clock_stats.clean_evictions,
+          clock_stats.pages_cleaned);
+  printf ("Frames: %lld frames scanned (longest scan %zu), %lld hand laps\n",
+          clock_stats.frames_scanned, clock_stats.longest_scan,
+          clock_stats.hand_laps);
+  printf ("Frames: %lld pages swapped out in %lld clusters\n",
+          clock_stats.clustered_pages, clock_stats.swap_clusters);
 }
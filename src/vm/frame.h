@@ -1,14 +1,25 @@
 #ifndef VM_FRAME_H
 #define VM_FRAME_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <threads/palloc.h>
 #include "vm/supp_page.h"
 
-void frame_init (void);
+/* Default number of free user frames below which the pageout daemon starts
+   evicting, and the number of free frames at which it stops. */
+#define PAGEOUT_LOW_WATERMARK 8
+#define PAGEOUT_HIGH_WATERMARK 16
+
+void frame_init (size_t low_watermark, size_t high_watermark,
+                 size_t resident_limit);
 void pin_frame (void *kpage);
 void unpin_frame (void *kpage);
 void *request_frame (enum palloc_flags additional_flags,
                      struct supp_page_mapping *mapped);
+void *request_shared_frame (struct shared_page *shared);
+bool frame_has_spare (void);
 void free_frame (void *kpage);
+void frame_print_stats (void);
 
 #endif /* vm/frame.h */
@@ -0,0 +1,237 @@
+#include <vm/shared_page.h>
+
+#include <debug.h>
+#include <stdio.h>
+
+#include <threads/malloc.h>
+#include <userprog/pagedir.h>
+#include <vm/frame.h>
+#include <vm/supp_page.h>
+
+/* Statistics about page sharing. */
+struct shared_page_stats
+  {
+    long long hits;   /* Faults satisfied by a frame already in memory. */
+    long long loads;  /* Faults which had to read the page from its file. */
+  };
+
+static unsigned shared_hash_func (const struct hash_elem *e, void *aux UNUSED);
+static bool shared_less_func (const struct hash_elem *a,
+                              const struct hash_elem *b,
+                              void *aux UNUSED);
+static struct shared_page *shared_from_elem (const struct hash_elem *e);
+static struct supp_page_mapping *mapper_from_elem (const struct list_elem *e);
+
+/* All shared pages which are mapped by at least one process. */
+static struct hash shared_pages;
+/* Protects shared_pages, and the mappers of every shared page.
+   This may be acquired while holding the frame table's lock, so the frame
+   table must never be called into while holding it. */
+static struct lock shared_pages_lock;
+static struct shared_page_stats shared_stats;
+
+/* Initializes the shared page table. */
+void
+shared_page_init (void)
+{
+  lock_init (&shared_pages_lock);
+  hash_init (&shared_pages, shared_hash_func, shared_less_func, NULL);
+}
+
+/* Finds the shared page for the given part of INODE, creating it if no process
+   maps it yet, and registers MAPPED as one of its mappers. */
+struct shared_page *
+shared_page_get (struct inode *inode, uint32_t offset, uint32_t read_bytes,
+                 struct supp_page_mapping *mapped)
+{
+  ASSERT (mapped->shared == NULL);
+
+  struct shared_page for_lookup;
+  for_lookup.inode = inode;
+  for_lookup.offset = offset;
+  for_lookup.read_bytes = read_bytes;
+
+  lock_acquire (&shared_pages_lock);
+  struct hash_elem *e = hash_find (&shared_pages, &for_lookup.elem);
+  struct shared_page *shared;
+  if (e != NULL)
+    {
+      shared = shared_from_elem (e);
+    }
+  else
+    {
+      shared = try_calloc (1, sizeof *shared);
+      shared->inode = inode;
+      shared->offset = offset;
+      shared->read_bytes = read_bytes;
+      shared->kpage = NULL;
+      list_init (&shared->mappers);
+      shared->mapper_cnt = 0;
+      lock_init (&shared->lock);
+      hash_insert (&shared_pages, &shared->elem);
+    }
+  list_push_back (&shared->mappers, &mapped->shared_elem);
+  ++shared->mapper_cnt;
+  mapped->shared = shared;
+  lock_release (&shared_pages_lock);
+
+  return shared;
+}
+
+/* Unmaps the shared page from MAPPED's process, and unregisters MAPPED as a
+   mapper. The last mapper to leave frees the frame and the shared page. */
+void
+shared_page_put (struct supp_page_mapping *mapped)
+{
+  struct shared_page *shared = mapped->shared;
+  ASSERT (shared != NULL);
+
+  lock_acquire (&shared->lock);
+  pagedir_clear_page (mapped->pagedir, mapped->uaddr);
+
+  lock_acquire (&shared_pages_lock);
+  list_remove (&mapped->shared_elem);
+  bool last = --shared->mapper_cnt == 0;
+  if (last)
+    {
+      hash_delete (&shared_pages, &shared->elem);
+    }
+  lock_release (&shared_pages_lock);
+
+  /* Nobody else can find the shared page now, and holding its lock stops the
+     frame from being evicted, so the frame can be freed safely. */
+  if (last)
+    {
+      free_frame (shared->kpage);
+    }
+  lock_release (&shared->lock);
+  mapped->shared = NULL;
+
+  if (last)
+    {
+      free (shared);
+    }
+}
+
+/* Whether any process mapping the shared page has accessed it. */
+bool
+shared_page_is_accessed (struct shared_page *shared)
+{
+  bool accessed = false;
+  lock_acquire (&shared_pages_lock);
+  struct list_elem *e;
+  for (e = list_begin (&shared->mappers); e != list_end (&shared->mappers);
+       e = list_next (e))
+    {
+      struct supp_page_mapping *mapper = mapper_from_elem (e);
+      if (pagedir_is_accessed (mapper->pagedir, mapper->uaddr))
+        {
+          accessed = true;
+          break;
+        }
+    }
+  lock_release (&shared_pages_lock);
+  return accessed;
+}
+
+/* Clears the accessed bit of the shared page in every process mapping it. */
+void
+shared_page_clear_accessed (struct shared_page *shared)
+{
+  lock_acquire (&shared_pages_lock);
+  struct list_elem *e;
+  for (e = list_begin (&shared->mappers); e != list_end (&shared->mappers);
+       e = list_next (e))
+    {
+      struct supp_page_mapping *mapper = mapper_from_elem (e);
+      pagedir_set_accessed (mapper->pagedir, mapper->uaddr, false);
+    }
+  lock_release (&shared_pages_lock);
+}
+
+/* Removes the shared page from the page directory of every process mapping it,
+   as its frame is being evicted. The shared page's lock must be held.
+   As shared pages are read-only, they are simply read from their file again
+   when they next fault. */
+void
+shared_page_unmap_all (struct shared_page *shared)
+{
+  ASSERT (lock_held_by_current_thread (&shared->lock));
+  lock_acquire (&shared_pages_lock);
+  struct list_elem *e;
+  for (e = list_begin (&shared->mappers); e != list_end (&shared->mappers);
+       e = list_next (e))
+    {
+      struct supp_page_mapping *mapper = mapper_from_elem (e);
+      pagedir_clear_page (mapper->pagedir, mapper->uaddr);
+    }
+  lock_release (&shared_pages_lock);
+  shared->kpage = NULL;
+}
+
+/* Records a fault on a shared page, which was either a hit on a frame already
+   in memory or had to load the page. */
+void
+shared_page_record_fault (bool hit)
+{
+  if (hit)
+    {
+      ++shared_stats.hits;
+    }
+  else
+    {
+      ++shared_stats.loads;
+    }
+}
+
+/* Prints statistics about page sharing. */
+void
+shared_page_print_stats (void)
+{
+  printf ("Shared pages: %lld hits, %lld loads\n",
+          shared_stats.hits, shared_stats.loads);
+}
+
+/* shared_pages hash function */
+static unsigned
+shared_hash_func (const struct hash_elem *e, void *aux UNUSED)
+{
+  struct shared_page *shared = shared_from_elem (e);
+  unsigned hash = hash_bytes (&shared->inode, sizeof shared->inode);
+  hash ^= hash_int (shared->offset);
+  return hash ^ hash_int (shared->read_bytes);
+}
+
+/* shared_pages less than function */
+static bool
+shared_less_func (const struct hash_elem *a, const struct hash_elem *b,
+                  void *aux UNUSED)
+{
+  struct shared_page *shared_a = shared_from_elem (a);
+  struct shared_page *shared_b = shared_from_elem (b);
+  if (shared_a->inode != shared_b->inode)
+    {
+      return shared_a->inode < shared_b->inode;
+    }
+  if (shared_a->offset != shared_b->offset)
+    {
+      return shared_a->offset < shared_b->offset;
+    }
+  return shared_a->read_bytes < shared_b->read_bytes;
+}
+
+/* Wrapper for the hash_entry macro, specific to shared_pages. */
+static struct shared_page *
+shared_from_elem (const struct hash_elem *e)
+{
+  ASSERT (e != NULL);
+  return hash_entry (e, struct shared_page, elem);
+}
+
+/* Wrapper for the list_entry macro, specific to shared_page.mappers. */
+static struct supp_page_mapping *
+mapper_from_elem (const struct list_elem *e)
+{
+  ASSERT (e != NULL);
+  return list_entry (e, struct supp_page_mapping, shared_elem);
+}
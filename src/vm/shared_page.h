@@ -0,0 +1,48 @@
+#ifndef VM_SHARED_PAGE_H
+#define VM_SHARED_PAGE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <lib/kernel/hash.h>
+#include <lib/kernel/list.h>
+
+#include <threads/synch.h>
+
+struct inode;
+struct supp_page_mapping;
+
+/* A page of a read-only file segment which may be mapped by several processes
+   at once, such as the code of an executable that is running more than once.
+   Shared pages are kept in a table keyed by the file's inode, the offset of the
+   page in the file and the number of bytes read from the file for the page, so
+   that every process mapping the same part of the same file uses one frame. */
+struct shared_page
+  {
+    struct hash_elem elem;   /* For placing this in the shared page table. */
+    struct inode *inode;     /* The file this page is read from. */
+    uint32_t offset;         /* Offset of the page in the file. */
+    uint32_t read_bytes;     /* Bytes read from the file, the rest is zeroed. */
+
+    /* The kernel virtual address of the frame holding this page, or NULL if
+       the page is not in memory. */
+    void *kpage;
+    /* The supp_page_mappings of every process mapping this page. Protected by
+       the shared page table's lock. */
+    struct list mappers;
+    unsigned mapper_cnt;     /* Number of entries in mappers. */
+    /* Held while the page is being read in, installed or evicted. */
+    struct lock lock;
+  };
+
+void shared_page_init (void);
+struct shared_page *shared_page_get (struct inode *inode, uint32_t offset,
+                                     uint32_t read_bytes,
+                                     struct supp_page_mapping *mapped);
+void shared_page_put (struct supp_page_mapping *mapped);
+bool shared_page_is_accessed (struct shared_page *shared);
+void shared_page_clear_accessed (struct shared_page *shared);
+void shared_page_unmap_all (struct shared_page *shared);
+void shared_page_record_fault (bool hit);
+void shared_page_print_stats (void);
+
+#endif /* vm/shared_page.h */
@@ -38,19 +38,25 @@ is_valid_stack_access (void *fault_addr, void *esp)
 
 /* Grow the stack up to the given stack pointer.
    This does no checking, assuming that the conditions for growing
-   the stack have been passed already. */
+   the stack have been passed already.
+   WRITE indicates whether the faulting access was a write. Only the page being
+   written to gets a frame straight away; the others map the zero page until
+   they are written to. */
 void
-grow_stack (void *fault_addr, void *esp)
+grow_stack (void *fault_addr, void *esp, bool write)
 {
   struct thread *t = thread_current ();
 
   /* Get the entries up to the smaller of fault_addr and esp. */
   void *alloc_up_to = fault_addr < esp ? fault_addr : esp;
+  void *fault_page = pg_round_down (fault_addr);
 
   /* Map all the entries. */
   while (t->stack_bottom > alloc_up_to)
     {
-      supp_page_map_addr_directly (&t->supp_page_table, t->stack_bottom - PGSIZE);
+      void *page = t->stack_bottom - PGSIZE;
+      supp_page_map_addr_directly (&t->supp_page_table, page,
+                                   write && page == fault_page);
       t->stack_bottom -= PGSIZE;
     }
 }
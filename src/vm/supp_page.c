@@ -8,8 +8,8 @@
 #include <lib/kernel/list.h>
 #include <lib/kernel/hash.h>
 
+#include <devices/block.h>
 #include <filesys/file.h>
-#include <filesys/filesys_lock.h>
 #include <filesys/off_t.h>
 #include <threads/malloc.h>
 #include <threads/palloc.h>
@@ -20,16 +20,29 @@
 #include <userprog/read_page.h>
 #include <userprog/install_page.h>
 #include <vm/frame.h>
+#include <vm/shared_page.h>
 #include <vm/swap.h>
 
 static struct supp_page_segment *segment_from_elem (const struct list_elem *e);
 static bool supp_page_segment_contains (struct supp_page_segment *segment, void *uaddr);
-static void setup_file_page (void *uaddr, void *kpage,
+static bool setup_file_page (void *uaddr, void *kpage,
                              struct supp_page_segment *segment);
+static bool supp_page_is_shareable (struct supp_page_segment *segment);
+static bool page_is_zero (struct supp_page_mapping *mapped);
+static void *map_shared_page (struct supp_page_mapping *mapped);
+static void *load_page (struct supp_page_mapping *mapped);
+static void *map_addr (struct supp_page_segment *segment, void *fault_addr,
+                       bool write);
+static void fault_around (struct supp_page_segment *segment, void *uaddr);
+static void swap_readahead (struct supp_page_segment *segment, void *uaddr,
+                            slot_no slot);
+static void *map_file_pages (struct supp_page_segment *segment, void *uaddr,
+                             uint8_t *start, uint8_t *end);
 static void supp_page_install_page (struct supp_page_mapping *mapped, void *kpage,
                                     struct supp_page_segment *segment);
 static uint32_t get_page_read_bytes (void *segment_addr, void *uaddr,
                                      uint32_t segment_read_bytes);
+static void write_mmapped_page (struct supp_page_mapping *mapped, void *kpage);
 
 static struct supp_page_mapping *create_mapped (struct supp_page_segment* segment, void *uaddr);
 static struct supp_page_mapping *mapped_from_mapping_elem (const struct hash_elem *e);
@@ -44,11 +57,76 @@ static struct supp_page_mapping *lookup_mapped (struct supp_page_segment *segmen
                                                 void *uaddr);
 
 
+/* Statistics about the zero page. */
+struct zero_page_stats
+  {
+    long long maps;   /* Faults which mapped the zero page. */
+    long long copies; /* Writes which replaced the zero page with a frame. */
+  };
+
+/* Statistics about fault-around. */
+struct fault_around_stats
+  {
+    long long faults; /* Faults which mapped pages around the faulting page. */
+    long long pages;  /* Pages mapped ahead of use, each saving a fault. */
+    long long sequential; /* Faults which continued a sequential stream. */
+    size_t longest_run;   /* Most sequential faults in a single stream. */
+  };
+
+/* Statistics about swap readahead. */
+struct swap_readahead_stats
+  {
+    long long pages;  /* Pages read in from swap ahead of use. */
+    long long hits;   /* Pages read ahead which were then used. */
+    long long misses; /* Pages read ahead which were evicted unused. */
+  };
+
+/* Statistics about the swap cache. */
+struct swap_cache_stats
+  {
+    long long hits;     /* Evictions which kept the page's copy in swap. */
+    long long rewrites; /* Cached copies freed as the page was written to. */
+  };
+
+/* A page of zeroes, mapped read-only in place of any page which would be
+   zeroed out on creation, until that page is first written to. */
+static void *zero_page;
+static struct zero_page_stats zero_stats;
+
+/* Size of the window of pages read in around a fault on a file page. */
+static size_t fault_around_pages;
+static struct fault_around_stats fault_around_stats;
+
+/* Number of pages on either side of a page read from swap which are read in
+   with it. Grows while the pages read ahead get used, and shrinks when they
+   are evicted unused. */
+static size_t swap_readahead_pages = SWAP_READAHEAD_MAX_PAGES / 2;
+static struct swap_readahead_stats swap_readahead_stats;
+/* Protects the two above. Never held while taking another lock. */
+static struct lock swap_readahead_lock;
+static struct swap_cache_stats swap_cache_stats;
+
+/* Initializes the supplementary page table module. A fault on a page of a
+   file is handled by reading in the not yet mapped file pages in the aligned
+   window of FAULT_AROUND_PAGES pages containing it, so that faults are saved
+   when the file is accessed sequentially. Each segment then adapts its window
+   to how its pages are accessed, up to READAHEAD_MAX_PAGES. A window of 0
+   pages disables this. */
+void
+supp_page_init (size_t fault_around_pages_)
+{
+  zero_page = palloc_get_page (PAL_ASSERT | PAL_ZERO);
+  fault_around_pages = fault_around_pages_;
+  lock_init (&swap_readahead_lock);
+}
+
 /* Initialize the given supplementary page table with the given page table. */
 void
 supp_page_table_init (struct supp_page_table *supp_page_table)
 {
   list_init (&supp_page_table->segments);
+  supp_page_table->resident_cnt = 0;
+  supp_page_table->clock_hand = 0;
 }
 
 /* Allocates a new supplementary page table segment, and insert it into the table. */
@@ -62,6 +140,9 @@ supp_page_create_segment (struct supp_page_table *supp_page_table,
   hash_init (&segment->mapped_pages, mapped_hash_func, mapped_less_func, NULL);
   segment->writable = writable;
   segment->size = size;
+  segment->ra_next = NULL;
+  segment->ra_run = 0;
+  segment->ra_window = fault_around_pages;
 
   list_push_back (&supp_page_table->segments, &segment->supp_elem);
   return segment;
@@ -99,9 +180,25 @@ supp_page_lookup_segment (struct supp_page_table *supp_page_table, void *fault_a
   return NULL;
 }
 
-/* Tries to get a frame and map the faulting page inside segment to this frame. */
+/* Tries to get a frame and map the faulting page inside segment to this frame.
+   WRITE indicates whether the faulting access was a write. Pages which would
+   be zeroed out are mapped to the zero page on reads, and only get a frame of
+   their own when first written to. Faults which read a page from a file also
+   read in its neighbouring file pages, while frames are to spare.
+   The reads are made in the fault-in I/O class, ahead of write-back. */
 void *
-supp_page_map_addr (struct supp_page_segment *segment, void *fault_addr)
+supp_page_map_addr (struct supp_page_segment *segment, void *fault_addr,
+                    bool write)
+{
+  enum block_io_class old_class = block_set_io_class (BLOCK_IO_FAULT);
+  void *kpage = map_addr (segment, fault_addr, write);
+  block_set_io_class (old_class);
+  return kpage;
+}
+
+/* Does the work of supp_page_map_addr. */
+static void *
+map_addr (struct supp_page_segment *segment, void *fault_addr, bool write)
 {
   /* Calculate the address of the page that fault_addr is inside. */
   void *uaddr = pg_round_down (fault_addr);
@@ -113,6 +210,126 @@ supp_page_map_addr (struct supp_page_segment *segment, void *fault_addr)
       mapped = create_mapped (segment, uaddr);
     }
 
+  if (mapped->zero_mapped)
+    {
+      /* Written to for the first time, so replace the zero page. */
+      ASSERT (write);
+      pagedir_clear_page (mapped->pagedir, mapped->uaddr);
+      mapped->zero_mapped = false;
+      ++zero_stats.copies;
+    }
+  else if (!write && page_is_zero (mapped))
+    {
+      if (!install_page (mapped->uaddr, zero_page, false))
+        {
+          thread_exit ();
+        }
+      mapped->zero_mapped = true;
+      ++zero_stats.maps;
+      return zero_page;
+    }
+
+  slot_no swap_slot_no = mapped->swap_slot_no;
+  bool from_file = swap_slot_no == NOT_SWAP && !page_is_zero (mapped);
+
+  /* Pages of read-only file segments are shared between processes. */
+  void *kpage;
+  if (supp_page_is_shareable (segment))
+    {
+      kpage = map_shared_page (mapped);
+    }
+  else
+    {
+      kpage = load_page (mapped);
+    }
+
+  if (from_file)
+    {
+      fault_around (segment, uaddr);
+    }
+  else if (swap_slot_no != NOT_SWAP)
+    {
+      swap_readahead (segment, uaddr, swap_slot_no);
+    }
+  return kpage;
+}
+
+/* Reads in the pages next to UADDR, the page of SEGMENT which was just read
+   from SLOT in swap, which were swapped out to the slots next to SLOT, as
+   pages written out together tend to be used together. Stops at the first
+   page in each direction that is not in the matching slot, and once frames
+   become scarce. */
+static void
+swap_readahead (struct supp_page_segment *segment, void *uaddr, slot_no slot)
+{
+  lock_acquire (&swap_readahead_lock);
+  size_t window = swap_readahead_pages;
+  lock_release (&swap_readahead_lock);
+
+  int direction;
+  for (direction = 1; direction >= -1; direction -= 2)
+    {
+      size_t i;
+      for (i = 1; i <= window; i++)
+        {
+          int offset = direction * (int) i;
+          uint8_t *page = (uint8_t *)uaddr + offset * PGSIZE;
+          if ((direction < 0 && slot < i) || page < (uint8_t *)segment->addr
+              || page >= (uint8_t *)segment->addr + segment->size)
+            {
+              break;
+            }
+          struct supp_page_mapping *mapped = lookup_mapped (segment, page);
+          if (mapped == NULL || mapped->swap_slot_no != slot + offset
+              || !frame_has_spare ())
+            {
+              break;
+            }
+          mapped->swap_readahead = true;
+          load_page (mapped);
+          lock_acquire (&swap_readahead_lock);
+          ++swap_readahead_stats.pages;
+          lock_release (&swap_readahead_lock);
+        }
+    }
+}
+
+/* Records whether a page read in from swap ahead of use was USED, either as
+   it was seen to be accessed, or as it is being evicted. The readahead window
+   adapts to how many of the pages read ahead are used. */
+void
+supp_page_readahead_result (struct supp_page_mapping *mapped, bool used)
+{
+  ASSERT (mapped->swap_readahead);
+  mapped->swap_readahead = false;
+  lock_acquire (&swap_readahead_lock);
+  if (used)
+    {
+      ++swap_readahead_stats.hits;
+      if (swap_readahead_pages < SWAP_READAHEAD_MAX_PAGES)
+        {
+          ++swap_readahead_pages;
+        }
+    }
+  else
+    {
+      ++swap_readahead_stats.misses;
+      /* Reading ahead a single page keeps measuring whether it is useful. */
+      if (swap_readahead_pages > 1)
+        {
+          swap_readahead_pages /= 2;
+        }
+    }
+  lock_release (&swap_readahead_lock);
+}
+
+/* Reads the page into a new frame of its own, from swap, its file or by
+   zeroing it out, and maps it. */
+static void *
+load_page (struct supp_page_mapping *mapped)
+{
+  struct supp_page_segment *segment = mapped->segment;
+
   /* Try to get a frame from the frame table. */
   void *kpage = request_frame (PAL_NONE, mapped);
   if (kpage == NULL)
@@ -127,12 +344,17 @@ supp_page_map_addr (struct supp_page_segment *segment, void *fault_addr)
   lock_acquire (&mapped->eviction_lock);
   if (mapped->swap_slot_no != NOT_SWAP)
     {
-      swap_retrieve (mapped->swap_slot_no, kpage);
+      swap_read (mapped->swap_slot_no, kpage);
+      mapped->cached_slot_no = mapped->swap_slot_no;
       mapped->swap_slot_no = NOT_SWAP;
     }
   else if (file_data != NULL)
     {
-      setup_file_page (mapped->uaddr, kpage, segment);
+      if (!setup_file_page (mapped->uaddr, kpage, segment))
+        {
+          lock_release (&mapped->eviction_lock);
+          thread_exit ();
+        }
     }
   else
     {
@@ -148,11 +370,161 @@ supp_page_map_addr (struct supp_page_segment *segment, void *fault_addr)
   return kpage;
 }
 
+/* Reads in file pages near UADDR, the page of SEGMENT which just faulted on
+   its file. A fault on the page just past the pages last read in continues a
+   sequential stream, so the window doubles and the pages following UADDR are
+   read ahead. Any other fault halves the window, and the not yet mapped pages
+   in the aligned window containing UADDR are read in instead. */
+static void
+fault_around (struct supp_page_segment *segment, void *uaddr)
+{
+  if (fault_around_pages == 0)
+    {
+      return;
+    }
+
+  uint8_t *start;
+  uint8_t *end;
+  if (uaddr == segment->ra_next)
+    {
+      ++fault_around_stats.sequential;
+      if (++segment->ra_run > fault_around_stats.longest_run)
+        {
+          fault_around_stats.longest_run = segment->ra_run;
+        }
+      segment->ra_window *= 2;
+      if (segment->ra_window > READAHEAD_MAX_PAGES)
+        {
+          segment->ra_window = READAHEAD_MAX_PAGES;
+        }
+      start = uaddr;
+      end = start + segment->ra_window * PGSIZE;
+    }
+  else
+    {
+      /* The first fault of a segment does not break any stream. */
+      if (segment->ra_next != NULL && segment->ra_window > 1)
+        {
+          segment->ra_window /= 2;
+        }
+      segment->ra_run = 0;
+      uint32_t window_size = segment->ra_window * PGSIZE;
+      start = (uint8_t *)((uint32_t)uaddr / window_size * window_size);
+      end = start + window_size;
+    }
+
+  /* Only the part of the segment read from the file is read ahead. */
+  uint32_t read_bytes = segment->file_data->read_bytes;
+  if (read_bytes > segment->size)
+    {
+      read_bytes = segment->size;
+    }
+  uint8_t *file_end = pg_round_up ((uint8_t *)segment->addr + read_bytes);
+  if (start < (uint8_t *)segment->addr)
+    {
+      start = segment->addr;
+    }
+  if (end > file_end || end < start)
+    {
+      end = file_end;
+    }
+
+  segment->ra_next = map_file_pages (segment, uaddr, start, end);
+}
+
+/* Maps the pages of SEGMENT from START up to END which have not been mapped
+   yet, except for UADDR, the page which faulted. Stops early once frames
+   become scarce, as the pages are only read in speculatively.
+   Returns the address of the page after the last one handled. */
+static void *
+map_file_pages (struct supp_page_segment *segment, void *uaddr,
+                uint8_t *start, uint8_t *end)
+{
+  bool mapped_any = false;
+  uint8_t *page;
+  for (page = start; page < end; page += PGSIZE)
+    {
+      if (page == uaddr || lookup_mapped (segment, page) != NULL)
+        {
+          continue;
+        }
+      if (!frame_has_spare ())
+        {
+          break;
+        }
+      struct supp_page_mapping *mapped = create_mapped (segment, page);
+      if (supp_page_is_shareable (segment))
+        {
+          map_shared_page (mapped);
+        }
+      else
+        {
+          load_page (mapped);
+        }
+      ++fault_around_stats.pages;
+      mapped_any = true;
+    }
+  if (mapped_any)
+    {
+      ++fault_around_stats.faults;
+    }
+  return page > (uint8_t *)uaddr ? page : (uint8_t *)uaddr + PGSIZE;
+}
+
+/* Maps the page of a read-only file segment to the frame shared by every
+   process mapping the same page of the same file, reading the page into a new
+   frame first if it is not in memory. */
+static void *
+map_shared_page (struct supp_page_mapping *mapped)
+{
+  struct supp_page_segment *segment = mapped->segment;
+  struct shared_page *shared = mapped->shared;
+  if (shared == NULL)
+    {
+      struct supp_page_file_data *file_data = segment->file_data;
+      uint32_t offset = file_data->offset +
+        ((uint32_t)mapped->uaddr - (uint32_t)segment->addr);
+      uint32_t page_read_bytes = get_page_read_bytes (segment->addr,
+                                                      mapped->uaddr,
+                                                      file_data->read_bytes);
+      shared = shared_page_get (file_get_inode (file_data->file), offset,
+                                page_read_bytes, mapped);
+    }
+
+  /* Holding the shared page's lock stops its frame being evicted. */
+  lock_acquire (&shared->lock);
+  void *kpage = shared->kpage;
+  bool hit = kpage != NULL;
+  if (!hit)
+    {
+      kpage = request_shared_frame (shared);
+      if (!setup_file_page (mapped->uaddr, kpage, segment))
+        {
+          lock_release (&shared->lock);
+          thread_exit ();
+        }
+      shared->kpage = kpage;
+    }
+  shared_page_record_fault (hit);
+
+  bool installed = install_page (mapped->uaddr, kpage, segment->writable);
+  if (!hit)
+    {
+      unpin_frame (kpage);
+    }
+  lock_release (&shared->lock);
+  if (!installed)
+    {
+      thread_exit ();
+    }
+  return kpage;
+}
+
 /* A convenience function for looking up a segment and mapping it.
    Automatically terminates the thread if the segment cannot be found. */
 void *
 supp_page_map_addr_directly (struct supp_page_table *supp_page_table,
-                             void *fault_addr)
+                             void *fault_addr, bool write)
 {
   struct supp_page_segment *segment =
     supp_page_lookup_segment (supp_page_table, fault_addr);
@@ -160,40 +532,114 @@ supp_page_map_addr_directly (struct supp_page_table *supp_page_table,
     {
       thread_exit ();
     }
-  return supp_page_map_addr (segment, fault_addr);
+  return supp_page_map_addr (segment, fault_addr, write);
+}
+
+/* Whether the page containing fault_addr is currently mapped to the zero
+   page, so that a write to it needs to give it a frame of its own. */
+bool
+supp_page_is_zero_mapped (struct supp_page_segment *segment, void *fault_addr)
+{
+  struct supp_page_mapping *mapped =
+    lookup_mapped (segment, pg_round_down (fault_addr));
+  return mapped != NULL && mapped->zero_mapped;
 }
 
+/* Records where the page now lives after being evicted: SWAP_SLOT_NO if it
+   was written to swap, or NOT_SWAP if it was not written out. A page which
+   was not written out goes back to the slot in the swap cache, if it has one,
+   while a page written to a new slot frees its old one. */
 void
 supp_page_swap_out (struct supp_page_mapping *mapped, slot_no swap_slot_no)
 {
+  if (mapped->cached_slot_no != NOT_SWAP)
+    {
+      if (swap_slot_no == NOT_SWAP)
+        {
+          swap_slot_no = mapped->cached_slot_no;
+          ++swap_cache_stats.hits;
+        }
+      else
+        {
+          swap_free_slot (mapped->cached_slot_no);
+          ++swap_cache_stats.rewrites;
+        }
+      mapped->cached_slot_no = NOT_SWAP;
+    }
   mapped->swap_slot_no = swap_slot_no;
 }
 
-/* Write a page back to the file it is from if it is mmapped.
+/* Frees the page's slot in the swap cache if the page has been written to
+   since it was read back from swap, as the slot no longer holds a copy of it.
+   Called by the clock on dirty pages, so that they do not hold on to a slot
+   for as long as they stay in memory. The page must be locked. */
+void
+supp_page_drop_cached_slot (uint32_t *pagedir,
+                            struct supp_page_mapping *mapped)
+{
+  if (mapped->cached_slot_no != NOT_SWAP
+      && pagedir_is_dirty (pagedir, mapped->uaddr))
+    {
+      swap_free_slot (mapped->cached_slot_no);
+      mapped->cached_slot_no = NOT_SWAP;
+      ++swap_cache_stats.rewrites;
+    }
+}
+
+/* Whether the page belongs to a memory mapped file, and so is written back to
+   its file rather than to swap. */
+bool
+supp_page_is_mmapped (struct supp_page_mapping *mapped)
+{
+  struct supp_page_file_data *file_data = mapped->segment->file_data;
+  return file_data != NULL && file_data->is_mmapped;
+}
+
+/* Whether evicting the page would require writing it out, to its file or to
+   swap, which is the case if it has been written to since it was read in.
+   Pages that do not can simply be dropped, and are read back from their file,
+   their slot in the swap cache or zeroed out again when they next fault. */
+bool
+supp_page_needs_write_back (uint32_t *pagedir, struct supp_page_mapping *mapped)
+{
+  return pagedir_is_dirty (pagedir, mapped->uaddr);
+}
+
+/* Write a page back to the file it is from if it is mmapped and dirty. The
+   contents are read through KPAGE, the frame currently holding the page, so
+   that this can be called from any thread.
    Returns false if it is not mmapped or the page is not a file page. */
 bool
-supp_page_write_mmapped (uint32_t *pagedir, struct supp_page_mapping *mapped)
+supp_page_write_mmapped (uint32_t *pagedir, struct supp_page_mapping *mapped,
+                         void *kpage)
 {
-  struct supp_page_segment *segment = mapped->segment;
-  if (segment->file_data != NULL)
+  if (kpage != NULL && supp_page_is_mmapped (mapped)
+      && pagedir_is_dirty (pagedir, mapped->uaddr))
     {
-      struct supp_page_file_data *file_data = segment->file_data;
-      if (pagedir_is_dirty (pagedir, mapped->uaddr) && file_data->is_mmapped &&
-          (uint8_t *)mapped->uaddr < (uint8_t *)segment->addr + file_data->read_bytes)
-        {
-          uint32_t page_read_bytes =
-            get_page_read_bytes (segment->addr, mapped->uaddr,
-                                 segment->file_data->read_bytes);
-          filesys_lock_acquire ();
-          file_seek (file_data->file, (uint32_t)mapped->uaddr - (uint32_t)segment->addr);
-          file_write (file_data->file, mapped->uaddr, page_read_bytes);
-          filesys_lock_release ();
-          return true;
-        }
+      write_mmapped_page (mapped, kpage);
+      return true;
     }
   return false;
 }
 
+/* Writes a dirty mmapped page back to its file while leaving it mapped, so
+   that it can later be evicted without any I/O. The dirty bit is cleared
+   before writing, so writes made during the write-back dirty the page again.
+   Returns false if there was nothing to write. */
+bool
+supp_page_clean_mmapped (uint32_t *pagedir, struct supp_page_mapping *mapped,
+                         void *kpage)
+{
+  if (!supp_page_is_mmapped (mapped)
+      || !pagedir_is_dirty (pagedir, mapped->uaddr))
+    {
+      return false;
+    }
+  pagedir_set_dirty (pagedir, mapped->uaddr, false);
+  write_mmapped_page (mapped, kpage);
+  return true;
+}
+
 /* Frees all the memory used by a particular supplementary page table in a
    thread. */
 void
@@ -220,6 +666,24 @@ supp_page_free_segment (struct supp_page_segment *segment,
   free (segment);
 }
 
+/* Prints statistics about the zero page. */
+void
+supp_page_print_stats (void)
+{
+  printf ("Zero page: %lld read faults mapped, %lld copied on write\n",
+          zero_stats.maps, zero_stats.copies);
+  printf ("Fault-around: %lld faults avoided, by %lld faults mapping "
+          "their neighbours\n",
+          fault_around_stats.pages, fault_around_stats.faults);
+  printf ("Readahead: %lld sequential faults, longest run %zu\n",
+          fault_around_stats.sequential, fault_around_stats.longest_run);
+  printf ("Swap readahead: %lld pages read ahead, %lld used, %lld unused\n",
+          swap_readahead_stats.pages, swap_readahead_stats.hits,
+          swap_readahead_stats.misses);
+  printf ("Swap cache: %lld evictions without a write, %lld rewritten\n",
+          swap_cache_stats.hits, swap_cache_stats.rewrites);
+}
+
 /* Get the supp_page_segment wrapping a supp_elem. */
 static struct supp_page_segment *
 segment_from_elem (const struct list_elem *e)
@@ -236,8 +700,35 @@ supp_page_segment_contains (struct supp_page_segment *segment, void *uaddr)
     (uint8_t *)uaddr <= (uint8_t *)segment->addr + segment->size;
 }
 
-/* Reads file data into the kpage, for virtual user page at uaddr. */
-static void
+/* Whether the page would be filled with zeroes when read in, as it has never
+   been written out to swap and does not hold any data from a file. */
+static bool
+page_is_zero (struct supp_page_mapping *mapped)
+{
+  struct supp_page_segment *segment = mapped->segment;
+  if (mapped->swap_slot_no != NOT_SWAP)
+    {
+      return false;
+    }
+  return segment->file_data == NULL
+    || get_page_read_bytes (segment->addr, mapped->uaddr,
+                            segment->file_data->read_bytes) == 0;
+}
+
+/* Whether the pages of the segment can be shared between processes. This is
+   the case for read-only segments of files which are not memory mapped, such
+   as the code of an executable. */
+static bool
+supp_page_is_shareable (struct supp_page_segment *segment)
+{
+  return segment->file_data != NULL && !segment->file_data->is_mmapped
+    && !segment->writable;
+}
+
+/* Reads file data into the kpage, for virtual user page at uaddr.
+   Returns false if the data could not be read, in which case read_page() has
+   already freed the frame. */
+static bool
 setup_file_page (void *uaddr, void *kpage, struct supp_page_segment *segment)
 {
   struct supp_page_file_data *file_data = segment->file_data;
@@ -247,31 +738,10 @@ setup_file_page (void *uaddr, void *kpage, struct supp_page_segment *segment)
   uint32_t offset_to_page = file_data->offset +
     ((uint32_t)uaddr - (uint32_t)segment->addr);
 
-  /* Acquiring lock on the filesystem. We may be page faulting from code that
-     has already acquired this lock, so we check first. */
-  bool acquired_lock = false;
-  if (!filesys_lock_held ())
-    {
-      acquired_lock = true;
-      filesys_lock_acquire ();
-    }
-
-  /* Read the data into the page, error check, and then release the lock. */
-  file_seek (file_data->file, offset_to_page);
-  if (!read_page (kpage, file_data->file, page_read_bytes,
-                  PGSIZE - page_read_bytes))
-    {
-      if (acquired_lock)
-        {
-          filesys_lock_release ();
-        }
-      free_frame (kpage);
-      thread_exit ();
-    }
-  if (acquired_lock)
-    {
-      filesys_lock_release ();
-    }
+  /* Read at an explicit offset, as the file's position may be in use by a
+     thread writing back another page of the file. */
+  return read_page (kpage, file_data->file, offset_to_page, page_read_bytes,
+                    PGSIZE - page_read_bytes);
 }
 
 /* Installs a kpage with uaddr into the current thread's pagedir. */
@@ -286,6 +756,23 @@ supp_page_install_page (struct supp_page_mapping *mapped, void *kpage,
     }
 }
 
+/* Writes the part of the mmapped page held in KPAGE which lies within the
+   file back to the file. */
+static void
+write_mmapped_page (struct supp_page_mapping *mapped, void *kpage)
+{
+  struct supp_page_segment *segment = mapped->segment;
+  struct supp_page_file_data *file_data = segment->file_data;
+  if ((uint8_t *)mapped->uaddr >= (uint8_t *)segment->addr + file_data->read_bytes)
+    {
+      return;
+    }
+  uint32_t page_read_bytes =
+    get_page_read_bytes (segment->addr, mapped->uaddr, file_data->read_bytes);
+  file_write_at (file_data->file, kpage, page_read_bytes,
+                 (uint32_t)mapped->uaddr - (uint32_t)segment->addr);
+}
+
 static uint32_t
 get_page_read_bytes (void *segment_addr, void *uaddr, uint32_t segment_read_bytes)
 {
@@ -313,8 +800,12 @@ create_mapped (struct supp_page_segment* segment, void *uaddr)
   struct supp_page_mapping *mapped = try_calloc (1, sizeof *mapped);
   mapped->segment = segment;
   mapped->uaddr = uaddr;
+  mapped->pagedir = thread_current ()->pagedir;
   mapped->swap_slot_no = NOT_SWAP;
+  mapped->cached_slot_no = NOT_SWAP;
+  mapped->zero_mapped = false;
   lock_init (&mapped->eviction_lock);
+  mapped->shared = NULL;
   hash_insert (&segment->mapped_pages, &mapped->mapping_elem);
   return mapped;
 }
@@ -352,13 +843,36 @@ supp_page_free_mapped (struct hash_elem *mapping_elem, void *pagedir_)
 {
   struct supp_page_mapping *mapped = mapped_from_mapping_elem (mapping_elem);
   uint32_t *pagedir = (uint32_t *)pagedir_;
-  supp_page_write_mmapped (pagedir, mapped);
+
+  if (mapped->shared != NULL)
+    {
+      shared_page_put (mapped);
+      free (mapped);
+      return;
+    }
+  if (mapped->zero_mapped)
+    {
+      pagedir_clear_page (pagedir, mapped->uaddr);
+      free (mapped);
+      return;
+    }
+
+  /* Wait for the page to finish being evicted, if it is in transit, and stop
+     it from being chosen for eviction while it is freed. */
+  lock_acquire (&mapped->eviction_lock);
+  void *kpage = pagedir_get_page (pagedir, mapped->uaddr);
+  supp_page_write_mmapped (pagedir, mapped, kpage);
   if (mapped->swap_slot_no != NOT_SWAP)
     {
       swap_free_slot (mapped->swap_slot_no);
     }
-  free_frame (pagedir_get_page (pagedir, mapped->uaddr));
+  if (mapped->cached_slot_no != NOT_SWAP)
+    {
+      swap_free_slot (mapped->cached_slot_no);
+    }
+  free_frame (kpage);
   pagedir_clear_page (pagedir, mapped->uaddr);
+  lock_release (&mapped->eviction_lock);
   free (mapped);
 }
 
@@ -8,9 +8,22 @@
 
 #include <filesys/file.h>
 #include <filesys/off_t.h>
+#include <vm/shared_page.h>
 #include <vm/swap.h>
 #include <threads/synch.h>
 
+/* Default number of pages, around and including a faulting page, which are
+   read in from a file by a single page fault. */
+#define FAULT_AROUND_PAGES 8
+
+/* Most pages read ahead by a fault continuing a sequential stream of faults
+   through a file segment. */
+#define READAHEAD_MAX_PAGES 32
+
+/* Most pages on either side of a page read from swap which are read in with
+   it, if they were swapped out to the neighbouring slots. */
+#define SWAP_READAHEAD_MAX_PAGES 8
+
 /* The supplementary page table keeps track of additional information on each
    page that the page table (in pagedir.h) cannot.
 
@@ -27,6 +40,8 @@
 struct supp_page_table
   {
     struct list segments; /* Entries in this table. */
+    size_t resident_cnt;  /* Number of frames holding this process' pages. */
+    size_t clock_hand;    /* Where replacement among own frames resumes. */
   };
 
 /* This is where the data for each segment that the user wants to load into
@@ -53,6 +68,11 @@ struct supp_page_segment
     /* Other properties */
     bool writable; /* Whether this segment is writable or not. */
     uint32_t size; /* The size of the segment. */
+
+    /* Readahead state for segments of files. */
+    void *ra_next;    /* Page whose fault would continue a sequential stream. */
+    size_t ra_run;    /* Number of sequential faults in the current stream. */
+    size_t ra_window; /* Number of pages read in by the next fault. */
   };
 
 /* Data pertaining to a segment that has data which exists in a file. */
@@ -78,10 +98,26 @@ struct supp_page_mapping
   struct hash_elem mapping_elem; /* For placing this in supp_page_segment. */
   struct supp_page_segment *segment; /* A pointer back to the segment that contains this. */
   void *uaddr; /* The virtual user address this page begins at. */
+  uint32_t *pagedir; /* The page directory of the process mapping this page. */
   slot_no swap_slot_no; /* Slot number of this page in swap, if it lies in swap. */
+  /* Slot the page was last read in from, which keeps a copy of the page while
+     it is in memory (the swap cache), so that evicting the page again costs
+     no write unless it has been written to since. NOT_SWAP if none. */
+  slot_no cached_slot_no;
+  /* Whether the page is mapped read-only to the global zero page, until it is
+     first written to. */
+  bool zero_mapped;
+  /* Whether the page was read in from swap ahead of use, and has not been
+     seen to be used yet. */
+  bool swap_readahead;
   struct lock eviction_lock;
+  /* The shared page this page maps, for pages of read-only file segments, or
+     NULL if the page has its own frame. */
+  struct shared_page *shared;
+  struct list_elem shared_elem; /* For placing this in shared_page.mappers. */
 };
 
+void supp_page_init (size_t fault_around_pages);
 void supp_page_table_init (struct supp_page_table *supp_page_table);
 struct supp_page_segment *supp_page_create_segment (struct supp_page_table *supp_page_table,
                                                     void *addr, bool writable,
@@ -93,14 +129,27 @@ struct supp_page_segment *supp_page_set_file_data (struct supp_page_segment *seg
                                                    bool is_mmapped);
 struct supp_page_segment *supp_page_lookup_segment (struct supp_page_table *supp_page_table,
                                                     void *uaddr);
-void *supp_page_map_addr (struct supp_page_segment *segment, void *fault_addr);
+void *supp_page_map_addr (struct supp_page_segment *segment, void *fault_addr,
+                          bool write);
 void *supp_page_map_addr_directly (struct supp_page_table *supp_page_table,
-                                   void *fault_addr);
+                                   void *fault_addr, bool write);
+bool supp_page_is_zero_mapped (struct supp_page_segment *segment,
+                               void *fault_addr);
 void supp_page_swap_out (struct supp_page_mapping *mapped, slot_no swap_slot_no);
-bool supp_page_write_mmapped (uint32_t *pagedir, struct supp_page_mapping *mapped);
+void supp_page_drop_cached_slot (uint32_t *pagedir,
+                                 struct supp_page_mapping *mapped);
+void supp_page_readahead_result (struct supp_page_mapping *mapped, bool used);
+bool supp_page_is_mmapped (struct supp_page_mapping *mapped);
+bool supp_page_needs_write_back (uint32_t *pagedir,
+                                 struct supp_page_mapping *mapped);
+bool supp_page_write_mmapped (uint32_t *pagedir, struct supp_page_mapping *mapped,
+                              void *kpage);
+bool supp_page_clean_mmapped (uint32_t *pagedir, struct supp_page_mapping *mapped,
+                              void *kpage);
 void supp_page_free_all (struct supp_page_table *supp_page_table,
                          uint32_t *pagedir);
 void supp_page_free_segment (struct supp_page_segment *segment,
                              uint32_t *pagedir);
+void supp_page_print_stats (void);
 
 #endif  /* vm/supp_page.h */
@@ -1,236 +1,313 @@
-#include <list.h>
+#include <limits.h>
+#include <round.h>
 #include <threads/malloc.h>
 
 #include "devices/block.h"
 #include "swap.h"
+#include "vm/compressed_swap.h"
 #include "threads/synch.h"
 #include "threads/vaddr.h"
 
-/* Macro for performing swap block reading/writing at a specific slot number. */
-#define block_do(KPAGE, SLOT, FUNC)                                    \
-  uint32_t curr_sector;                                                \
-  for (curr_sector = 0; curr_sector < SECTORS_PER_PAGE; curr_sector++) \
-    {                                                                  \
-      FUNC (swap_block,                                                \
-            (convert_slot_to_sector (SLOT) + curr_sector),             \
-            (((uint8_t*) KPAGE) + (curr_sector * BLOCK_SECTOR_SIZE))); \
-    }
+/* Most pages written to the swap device by a single request. */
+#define MAX_RUN_PAGES 8
 
-/* Struct inserted into the list of free ranges,
-   marks start (inclusive) and end of range (exclusive). */
-struct range
-  {
-    slot_no start; /* Number of first free swap slot. */
-    slot_no end;   /* End of range (exclusive i.e. a used slot). */
-    struct list_elem elem; /* Used by the free_slot_list. */
-  };
+/* Word of the swap map, holding the used bits of SLOTS_PER_WORD slots. */
+typedef unsigned long swap_word;
+#define SLOTS_PER_WORD (sizeof (swap_word) * CHAR_BIT)
+#define FULL_WORD ((swap_word) -1)
 
-/* Enum describing how to extend the 2 ranges either side of a swap slot being
-   freed. */
-enum action_enum
+/* Map of the used swap slots, with one bit per slot set while the slot is in
+   use. It is allocated once, so freeing a slot never needs any memory.
+   Allocation is next-fit: searching resumes from the word of the last
+   allocated slot, skipping full words whole. */
+struct swap_map
   {
-    EXTEND_NONE,
-    EXTEND_SMALLER,
-    EXTEND_LARGER,
-    EXTEND_BOTH
+    swap_word *words;   /* Used bits of the slots. */
+    size_t word_cnt;    /* Number of words in the map. */
+    slot_no slot_cnt;   /* Number of slots in swap. */
+    slot_no free_cnt;   /* Number of free slots. */
+    size_t hint;        /* Word at which the next search starts. */
+    struct lock lock;   /* Protects the map. */
   };
 
 const uint32_t SECTORS_PER_PAGE = PGSIZE / BLOCK_SECTOR_SIZE;
-struct list free_slot_list;
 struct block *swap_block;
-struct lock free_slot_list_lock;
+static struct swap_map swap_map;
 
-static struct range *range_entry (const struct list_elem *);
 static block_sector_t convert_slot_to_sector (slot_no);
-static enum action_enum check_extend_smaller (struct list_elem *, slot_no slot);
-static enum action_enum check_extend_larger (struct list_elem *, slot_no slot);
-static void create_range (slot_no, slot_no);
-static void delete_range (struct range *);
+static void write_run_to_device (slot_no first, void **kpages, size_t cnt);
 static slot_no get_next_free_slot (void);
-static bool range_lt (const struct list_elem *, const struct list_elem *,
-                      void *);
+static slot_no get_free_run (size_t cnt);
 
 /* Initialise swap table. N.B. This assumes pages divide evenly into sectors. */
 void
 swap_init (void)
 {
-  list_init (&free_slot_list);
   swap_block = block_get_role (BLOCK_SWAP);
-  lock_init (&free_slot_list_lock);
+  lock_init (&swap_map.lock);
 
-  /* Create initial free range and set to whole of swap space. */
-  lock_acquire (&free_slot_list_lock);
-  create_range (0, block_size (swap_block) / SECTORS_PER_PAGE);
-  lock_release (&free_slot_list_lock);
+  /* Every slot starts out free. The bits past the last slot in the last word
+     are marked as used, so that they are never allocated. */
+  swap_map.slot_cnt = block_size (swap_block) / SECTORS_PER_PAGE;
+  swap_map.free_cnt = swap_map.slot_cnt;
+  swap_map.word_cnt = DIV_ROUND_UP (swap_map.slot_cnt, SLOTS_PER_WORD);
+  swap_map.hint = 0;
+  swap_map.words = try_calloc (swap_map.word_cnt, sizeof (swap_word));
+  if (swap_map.slot_cnt % SLOTS_PER_WORD != 0)
+    {
+      swap_map.words[swap_map.word_cnt - 1] =
+        FULL_WORD << (swap_map.slot_cnt % SLOTS_PER_WORD);
+    }
 }
 
-/* Writes a page to the swap file.
+/* Writes a page to the swap file. The page is kept compressed in memory if
+   it can be, and only written to the swap device otherwise.
    Returns the slot_no which page now lives in. */
 slot_no
 swap_write (void *kpage)
 {
-  lock_acquire (&free_slot_list_lock);
+  lock_acquire (&swap_map.lock);
   slot_no slot = get_next_free_slot ();
-  lock_release (&free_slot_list_lock);
+  lock_release (&swap_map.lock);
 
-  block_do (kpage, slot, block_write);
+  if (!compressed_swap_store (slot, kpage))
+    {
+      swap_write_to_device (slot, kpage);
+    }
   return slot;
 }
 
-/* Retrieves a page from swap by copying the page at slot_no into page.
-   Also frees the slot. */
-void swap_retrieve (slot_no slot, void *kpage)
-{
-  ASSERT (slot < (block_size (swap_block) / SECTORS_PER_PAGE));
-  block_do (kpage, slot, block_read);
-  swap_free_slot (slot); /* Internally synchronised */
-}
-
-/* Reinserts a free slot into free_slot_list.
-   May create, extend or merge ranges. */
-void swap_free_slot (slot_no slot)
+/* Writes the CNT pages in KPAGES to swap, storing the slot each page now
+   lives in into SLOTS. The pages are given a run of consecutive slots when
+   one is free, so that they are written to consecutive sectors, and so that
+   pages written together are also read back from nearby. */
+void
+swap_write_cluster (void **kpages, size_t cnt, slot_no *slots)
 {
-  ASSERT (slot < (block_size (swap_block) / SECTORS_PER_PAGE));
-
-  lock_acquire (&free_slot_list_lock);
-
-  /* Find the first range with a start point greater than slot. */
-  struct list_elem *e = list_begin (&free_slot_list);
-  while (e != list_end (&free_slot_list))
+  lock_acquire (&swap_map.lock);
+  slot_no first = get_free_run (cnt);
+  size_t i;
+  for (i = 0; i < cnt; i++)
     {
-      struct range *free_range = range_entry (e);
-      ASSERT (free_range->start != slot); /* slot should not be free yet! */
-      if (free_range->start > slot) {
-        break;
-      }
-      e = list_next (e);
+      slots[i] = first != NOT_SWAP ? first + i : get_next_free_slot ();
     }
+  lock_release (&swap_map.lock);
 
-  enum action_enum action = check_extend_smaller (e, slot);
-  if (check_extend_larger (e, slot) == EXTEND_LARGER)
+  /* Pages which are not kept compressed and have consecutive slots are
+     written to the device together. */
+  size_t run_start = 0;
+  size_t run_len = 0;
+  for (i = 0; i < cnt; i++)
     {
-      action = action == EXTEND_NONE ? EXTEND_LARGER : EXTEND_BOTH;
+      if (compressed_swap_store (slots[i], kpages[i]))
+        {
+          continue;
+        }
+      if (run_len > 0 && (run_start + run_len != i
+                          || slots[run_start] + run_len != slots[i]))
+        {
+          write_run_to_device (slots[run_start], kpages + run_start, run_len);
+          run_len = 0;
+        }
+      if (run_len == 0)
+        {
+          run_start = i;
+        }
+      run_len++;
+    }
+  if (run_len > 0)
+    {
+      write_run_to_device (slots[run_start], kpages + run_start, run_len);
     }
-
-  switch (action)
-  {
-  case (EXTEND_NONE):
-    create_range (slot, slot + 1); /* N.B. lock already acquired */
-    break;
-  case (EXTEND_SMALLER):
-    range_entry (list_prev (e))->end++;
-    break;
-  case (EXTEND_LARGER):
-    range_entry (e)->start--;
-    break;
-  case (EXTEND_BOTH):
-    range_entry (list_prev (e))->end = range_entry (e)->end;
-    delete_range (range_entry (e));
-    break;
-  }
-  lock_release (&free_slot_list_lock);
 }
 
-/* Wrapper for the list_entry macro, returning the pointer
-   to the struct range which contains the list_elem *e.
-   Must hold free_slot_list_lock before calling. */
-static struct range *
-range_entry (const struct list_elem *e)
+/* Writes a page to its slot on the swap device itself, bypassing the
+   compressed tier. */
+void
+swap_write_to_device (slot_no slot, void *kpage)
 {
-  ASSERT (lock_held_by_current_thread (&free_slot_list_lock));
-  return list_entry (e, struct range, elem);
+  write_run_to_device (slot, &kpage, 1);
 }
 
-/* Converts a slot_no to a block_sector_t. */
-static block_sector_t
-convert_slot_to_sector (slot_no slot)
+/* Reads a page from swap by copying the page at slot_no into page. The slot
+   stays allocated, so that it can keep the page while the page is clean. */
+void swap_read (slot_no slot, void *kpage)
 {
-  return slot * SECTORS_PER_PAGE;
-}
-
-/* Checks whether inserting slot will extend
-   the smaller range containing curr_elem. */
-static enum action_enum
-check_extend_smaller (struct list_elem *curr_elem, slot_no slot)
-{
-  struct list_elem *prev_elem = list_prev (curr_elem);
-  if (prev_elem != list_head (&free_slot_list))
-    {
-      return range_entry (prev_elem)->end == slot ? EXTEND_SMALLER : EXTEND_NONE;
-    }
-  else
+  ASSERT (slot < swap_map.slot_cnt);
+  if (!compressed_swap_load (slot, kpage))
     {
-      return EXTEND_NONE;
+      void *sectors[PGSIZE / BLOCK_SECTOR_SIZE];
+      uint32_t i;
+      for (i = 0; i < SECTORS_PER_PAGE; i++)
+        {
+          sectors[i] = (uint8_t *) kpage + i * BLOCK_SECTOR_SIZE;
+        }
+      block_read_multiple (swap_block, convert_slot_to_sector (slot),
+                           SECTORS_PER_PAGE, sectors);
     }
 }
 
-/* Checks whether inserting slot will extend
-   the range containing curr_elem. */
-static enum action_enum
-check_extend_larger (struct list_elem *curr_elem, slot_no slot)
+/* Marks a slot as free again in the swap map. */
+void swap_free_slot (slot_no slot)
 {
-  if (curr_elem != list_head (&free_slot_list))
-    {
-      return (range_entry (curr_elem)->start - 1) == slot ?
-        EXTEND_LARGER : EXTEND_NONE;
-    }
-  else
+  ASSERT (slot < swap_map.slot_cnt);
+  swap_word bit = (swap_word) 1 << (slot % SLOTS_PER_WORD);
+  if (!compressed_swap_invalidate (slot))
     {
-      return EXTEND_NONE;
+      /* The compressed tier frees the slot once it has been written. */
+      return;
     }
+
+  lock_acquire (&swap_map.lock);
+  swap_word *word = &swap_map.words[slot / SLOTS_PER_WORD];
+  ASSERT ((*word & bit) != 0); /* slot should not be free yet! */
+  *word &= ~bit;
+  swap_map.free_cnt++;
+  lock_release (&swap_map.lock);
 }
 
-/* Allocates memory for a range,
-   and inserts it into free_slot_list in the correct place. */
-static void
-create_range (slot_no start, slot_no end)
+/* Converts a slot_no to a block_sector_t. */
+static block_sector_t
+convert_slot_to_sector (slot_no slot)
 {
-  struct range *new_range = try_malloc (sizeof *new_range);
-  new_range->start = start;
-  new_range->end = end;
-  list_insert_ordered (&free_slot_list, &new_range->elem, range_lt, NULL);
+  return slot * SECTORS_PER_PAGE;
 }
 
-/* Removes a range from free_slot_list and frees its memory. */
+/* Writes the CNT pages in KPAGES to CNT consecutive slots on the swap device,
+   starting at FIRST, with as few requests as possible. The writes take the
+   I/O class of the calling thread, which is background for the pageout
+   daemon, but stays that of the fault when a faulting thread evicts. */
 static void
-delete_range (struct range *range_to_delete)
+write_run_to_device (slot_no first, void **kpages, size_t cnt)
 {
-  list_remove (&range_to_delete->elem);
-  free (range_to_delete);
+  const void *sectors[MAX_RUN_PAGES * PGSIZE / BLOCK_SECTOR_SIZE];
+  ASSERT (first + cnt <= swap_map.slot_cnt);
+  while (cnt > 0)
+    {
+      size_t page_cnt = cnt < MAX_RUN_PAGES ? cnt : MAX_RUN_PAGES;
+      size_t sector_cnt = 0;
+      size_t i;
+      uint32_t j;
+      for (i = 0; i < page_cnt; i++)
+        {
+          for (j = 0; j < SECTORS_PER_PAGE; j++)
+            {
+              sectors[sector_cnt++] =
+                (uint8_t *) kpages[i] + j * BLOCK_SECTOR_SIZE;
+            }
+        }
+      block_write_multiple (swap_block, convert_slot_to_sector (first),
+                            sector_cnt, sectors);
+      first += page_cnt;
+      kpages += page_cnt;
+      cnt -= page_cnt;
+    }
 }
 
-/* Gets the next available free slot,
-   and deletes the range it was in if it is now empty. */
+/* Gets the next available free slot, searching onwards from the word the last
+   slot was allocated from, and marks it as used.
+   Must hold the swap map's lock. */
 static slot_no
 get_next_free_slot (void)
 {
-  struct list_elem *free_range_elem = list_begin (&free_slot_list);
-  if (free_range_elem == list_tail (&free_slot_list))
+  ASSERT (lock_held_by_current_thread (&swap_map.lock));
+  if (swap_map.free_cnt == 0)
     {
       /* Out of swap file space! Panic! */
       PANIC ("Out of swap space!");
     }
 
-  struct range *free_range = range_entry (free_range_elem);
-  int ret = free_range->start;
-  free_range->start++;
+  /* There is a free slot, so some word is not full. */
+  size_t i = swap_map.hint;
+  while (swap_map.words[i] == FULL_WORD)
+    {
+      if (++i >= swap_map.word_cnt)
+        {
+          i = 0;
+        }
+    }
 
-  /* Remove the range if it's empty. */
-  if (free_range->start == free_range->end) {
-    delete_range(free_range);
-  }
-  return ret;
+  swap_word *word = &swap_map.words[i];
+  unsigned bit = __builtin_ctzl (~*word);
+  *word |= (swap_word) 1 << bit;
+  swap_map.free_cnt--;
+  swap_map.hint = i;
+  return i * SLOTS_PER_WORD + bit;
 }
 
-/* list_less_func for comparing thread priority. Note that here, A
-   is the element to be inserted and B is the element in the list. */
-static bool
-range_lt (const struct list_elem *new_elem,
-          const struct list_elem *ori_elem,
-          void *aux UNUSED)
+/* Finds a run of CNT consecutive free slots, searching onwards from the word
+   the last slot was allocated from, and marks them as used. Runs do not wrap
+   around the end of swap.
+   Returns the first slot of the run, or NOT_SWAP if there is no such run.
+   Must hold the swap map's lock. */
+static slot_no
+get_free_run (size_t cnt)
 {
-  int new = range_entry (new_elem)->start;
-  int ori = range_entry (ori_elem)->start;
+  ASSERT (lock_held_by_current_thread (&swap_map.lock));
+  if (cnt == 0 || swap_map.free_cnt < cnt)
+    {
+      return NOT_SWAP;
+    }
+
+  slot_no run_start = 0;
+  size_t run_len = 0;
+  size_t i = swap_map.hint;
+  size_t n;
+  for (n = 0; n < swap_map.word_cnt; n++)
+    {
+      if (i == 0)
+        {
+          run_len = 0;
+        }
+      swap_word word = swap_map.words[i];
+      if (word == FULL_WORD)
+        {
+          run_len = 0;
+        }
+      else if (word == 0 && run_len + SLOTS_PER_WORD < cnt)
+        {
+          /* The whole word extends the run, without completing it. */
+          if (run_len == 0)
+            {
+              run_start = i * SLOTS_PER_WORD;
+            }
+          run_len += SLOTS_PER_WORD;
+        }
+      else
+        {
+          unsigned bit;
+          for (bit = 0; bit < SLOTS_PER_WORD; bit++)
+            {
+              if (word & ((swap_word) 1 << bit))
+                {
+                  run_len = 0;
+                  continue;
+                }
+              if (run_len == 0)
+                {
+                  run_start = i * SLOTS_PER_WORD + bit;
+                }
+              if (++run_len == cnt)
+                {
+                  goto found;
+                }
+            }
+        }
+      if (++i >= swap_map.word_cnt)
+        {
+          i = 0;
+        }
+    }
+  return NOT_SWAP;
 
-  return new < ori;
+ found:
+  for (n = 0; n < cnt; n++)
+    {
+      slot_no slot = run_start + n;
+      swap_map.words[slot / SLOTS_PER_WORD] |=
+        (swap_word) 1 << (slot % SLOTS_PER_WORD);
+    }
+  swap_map.free_cnt -= cnt;
+  swap_map.hint = (run_start + cnt - 1) / SLOTS_PER_WORD;
+  return run_start;
 }
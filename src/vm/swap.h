@@ -1,6 +1,7 @@
 #ifndef VM_SWAP_H
 #define VM_SWAP_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define NOT_SWAP INT32_MAX
@@ -10,7 +11,9 @@ typedef uint32_t slot_no;
 
 void swap_init (void);
 slot_no swap_write (void *);
-void swap_retrieve (slot_no, void *);
+void swap_write_cluster (void **kpages, size_t cnt, slot_no *slots);
+void swap_write_to_device (slot_no, void *);
+void swap_read (slot_no, void *);
 void swap_free_slot (slot_no slot);
 
 #endif /* vm/swap.h */